@@ -1,33 +1,132 @@
 #include "KDtree.hpp"
+#include "math/vector_batch.hpp"
 
 using namespace std;
 namespace _462 {
 
+// Lookup tables for decoding the quantized photon directions.
+
+struct DirectionTable {
+	real_t cos_theta[256];
+	real_t sin_theta[256];
+	real_t cos_phi[256];
+	real_t sin_phi[256];
+
+	DirectionTable() {
+		for (int i=0; i<256; i++) {
+			real_t angle = (i + 0.5) * (1.0/256.0) * PI;
+			cos_theta[i] = cos(angle);
+			sin_theta[i] = sin(angle);
+			cos_phi[i] = cos(2.0*angle);
+			sin_phi[i] = sin(2.0*angle);
+		}
+	}
+};
+
+static const DirectionTable& direction_table() {
+	static const DirectionTable table;
+	return table;
+}
+
+void Photon::set_position(const Vector3& p) {
+
+	position[0] = float(p.x);
+	position[1] = float(p.y);
+	position[2] = float(p.z);
+}
+
+Vector3 Photon::get_position() const {
+
+	return Vector3(position[0], position[1], position[2]);
+}
+
+void Photon::set_power(const Color3& c) {
+
+	real_t v = max(c.r, max(c.g, c.b));
+	if (v < 1e-32) {
+		power[0] = power[1] = power[2] = power[3] = 0;
+		return;
+	}
+
+	int e;
+	real_t m = frexp(v, &e) * 256.0 / v;
+	power[0] = (unsigned char)(max(c.r, real_t(0)) * m);
+	power[1] = (unsigned char)(max(c.g, real_t(0)) * m);
+	power[2] = (unsigned char)(max(c.b, real_t(0)) * m);
+	power[3] = (unsigned char)(e + 128);
+}
+
+Color3 Photon::get_power() const {
+
+	if (power[3] == 0) {
+		return Color3(0.0, 0.0, 0.0);
+	}
+	real_t f = ldexp(1.0, int(power[3]) - (128+8));
+	return Color3((power[0]+0.5)*f, (power[1]+0.5)*f, (power[2]+0.5)*f);
+}
+
+// quantizes a unit vector to the 256x256 angle bins of the lookup table
+static void encode_direction(const Vector3& d, unsigned char& theta, unsigned char& phi) {
+
+	int t = (int)floor(acos(clamp(d.z, real_t(-1), real_t(1))) * (256.0/PI));
+	int p = (int)floor(atan2(d.y, d.x) * (256.0/(2.0*PI)));
+	theta = (unsigned char)min(t, 255);
+	phi = (unsigned char)(p < 0 ? p + 256 : min(p, 255));
+}
+
+void Photon::set_direction(const Vector3& d) {
+
+	encode_direction(d, theta, phi);
+}
+
+Vector3 Photon::get_direction() const {
+
+	const DirectionTable& table = direction_table();
+	return Vector3(table.sin_theta[theta]*table.cos_phi[phi],
+	               table.sin_theta[theta]*table.sin_phi[phi],
+	               table.cos_theta[theta]);
+}
+
+// same encoding as the direction, reusing its lookup table to decode
+void Photon::set_normal(const Vector3& n) {
+
+	encode_direction(n, ntheta, nphi);
+}
+
+Vector3 Photon::get_normal() const {
+
+	const DirectionTable& table = direction_table();
+	return Vector3(table.sin_theta[ntheta]*table.cos_phi[nphi],
+	               table.sin_theta[ntheta]*table.sin_phi[nphi],
+	               table.cos_theta[ntheta]);
+}
+
 // Functions used to sort 
 
 bool sort_x(const Photon &a, const Photon &b) {
 
-	return a.position.x < b.position.x;	
+	return a.position[0] < b.position[0];
 }
 
 bool sort_y(const Photon &a, const Photon &b) {
 
-	return a.position.y < b.position.y;	
+	return a.position[1] < b.position[1];
 }
 
 bool sort_z(const Photon &a, const Photon &b) {
 
-	return a.position.z < b.position.z;	
+	return a.position[2] < b.position[2];
 }
 
-bool sort_distance(const Photon &a, const Photon &b) {
+bool sort_distance(const NearPhoton &a, const NearPhoton &b) {
 
-	return a.distance < b.distance;
+	return a.dist2 < b.dist2;
 }
 
 KDtree::KDtree(){
 
-	root = NULL;
+	num_map = 0;
+	map = NULL;
 }
 
 KDtree::~KDtree(){
@@ -35,31 +134,37 @@ KDtree::~KDtree(){
 
 }
 
+// sorts map_enter in place into kd-tree order
 void KDtree::insert_list(Photon map_enter[]) {
 	
 	map = map_enter;
+	if (num_map == 0) {
+		return;
+	}
 	// sort it first according to dim_index value
 	sort(map, map+num_map, sort_x);
-	// use preorder to store nodes into KDtree
-	preorder_insert_node(root, 0, num_map-1, 1);
-	// printout all the nodes
-	//traverse_node(root, 0);
+	// arrange the subtrees in preorder
+	preorder_insert_node(0, num_map-1, 1);
+
+}
+
+// uses a photon array that is already in kd-tree order, e.g. loaded from disk
+void KDtree::set_list(Photon map_enter[]) {
+
+	map = map_enter;
+}
+
+void KDtree::build(Photon map_enter[], size_t num, real_t /*max_radius2*/) {
 
+	num_map = num;
+	insert_list(map_enter);
 }
 
-Node* KDtree::preorder_insert_node(Node* node, int start, int end, size_t dim_index) {
+void KDtree::preorder_insert_node(int start, int end, size_t dim_index) {
 
 	// get the mid element, if the total num is even, then take the left of the mid one.
+	// it stays in place as the root of this range.
 	int num = start + (end-start)/2;
-	Node* insert = new Node();
-	insert->left = NULL;
-	insert->right = NULL;
-	insert->data = map[num]; 
-
-	// if this is started from root, insert root first.
-	if(root==NULL) {
-		root = insert;
-	}
 
 	if (start!=end) {
 		// insert the left half part
@@ -78,7 +183,7 @@ Node* KDtree::preorder_insert_node(Node* node, int start, int end, size_t dim_in
 				sort(map+start, map+mid+1, sort_z);
 			}
 
-			insert->left = preorder_insert_node(insert->left, start, num-1, dim_index+1);
+			preorder_insert_node(start, num-1, dim_index+1);
 		}
 		// insert the right half part
 
@@ -93,115 +198,130 @@ Node* KDtree::preorder_insert_node(Node* node, int start, int end, size_t dim_in
 				sort(map+num+1, map+end+1, sort_z);
 				break;
 		}
-		insert->right = preorder_insert_node(insert->right, num+1, end, dim_index+1);
+		preorder_insert_node(num+1, end, dim_index+1);
 	}
 
-	return insert;
-
 }
 
-void KDtree::traverse_node(Node* node, size_t index) {
-	if (node !=NULL) {
-
-		//printf("Level %d node = %f %f %f \n", index, node->data.position.x, node->data.position.y, node->data.position.z);
-		index++;
-		traverse_node(node->left, index);
-		traverse_node(node->right, index);
-	}
-}
-
-Color3 KDtree::calculate_color(Vector3 pt, size_t photon_num) {
+// Irradiance at pt from the photon_num nearest photons. Only photons arriving
+// on the side the normal faces contribute. The squared gather radius is
+// returned through radius2 if it is given.
+Color3 KDtree::calculate_irradiance(Vector3 pt, Vector3 normal, size_t photon_num, real_t* radius2_out) {
 	
-	Photon photons[photon_num];
+	NearPhoton photons[photon_num];
 	size_t dim = 0;
 	int num_index = 0;
     
+	if (num_map == 0) {
+		return Color3(0.0, 0.0, 0.0);
+	}
 	// save photons into photons array
-	find_node(pt, photons, dim, num_index, root);
-	sort(photons, photons+num_index, sort_distance);
-	real_t radius = photons[num_index-1].distance;
+	find_node(pt, photons, dim, num_index, 0, num_map-1);
+	if (num_index == 0) {
+		return Color3(0.0, 0.0, 0.0);
+	}
+	real_t radius2 = photons[num_index-1].dist2;
+	if (radius2_out) {
+		*radius2_out = radius2;
+	}
 	Color3 sum(0.0, 0.0, 0.0);
 
-	Color3 color_at_pt = photons[0].materialColor;
-	for (size_t i=0; i<photon_num; i++) {
-	    sum += photons[i].intensity*color_at_pt*photons[i].dTimesn;	
+	// decode the directions first, for one batched dot product
+	real_t dir_x[photon_num], dir_y[photon_num], dir_z[photon_num], cos_in[photon_num];
+	for (int i=0; i<num_index; i++) {
+		Vector3 d = photons[i].photon->get_direction();
+		dir_x[i] = d.x;
+		dir_y[i] = d.y;
+		dir_z[i] = d.z;
 	}
-	Color3 final = sum * (1/(PI*radius*radius));
+	dot_n(dir_x, dir_y, dir_z, -normal, cos_in, num_index);
+
+	for (int i=0; i<num_index; i++) {
+		if (cos_in[i] > 0) {
+			sum += photons[i].photon->get_power()*cos_in[i];
+		}
+	}
+	Color3 final = sum * (1/(PI*radius2));
 	return final;
 
 }
 
+Color3 KDtree::calculate_color(Vector3 pt, Vector3 normal, Color3 diffuse, size_t photon_num) {
 
-void KDtree::find_node(Vector3 pt, Photon photons[], size_t dim, int &num_index, Node* node) {
-	
-	bool left_flag;
-	
-	real_t tmp_distance = distance(pt, node->data.position);
-	// go back when reaching leave node
-	if (node->left==NULL && node->right==NULL) {
-		
-	    // store photon to array
-	    // if the array is not full
-	    if (num_index < num_full ) {
+	return calculate_irradiance(pt, normal, photon_num)*diffuse;
+}
+
+// keep the num_full closest photons seen so far, sorted by distance
+static inline void add_near_photon(NearPhoton photons[], int &num_index, int num_full,
+                                   const Photon* photon, real_t dist2) {
 
-		photons[num_index] = node->data;
-		photons[num_index].distance = tmp_distance;
+	if (num_index < num_full) {
+
+		photons[num_index].photon = photon;
+		photons[num_index].dist2 = dist2;
 		num_index++;
 		sort(photons, photons+num_index, sort_distance);
 
-		//if the array is full.
-		}else if (tmp_distance<photons[num_index-1].distance) {
+	//if the array is full.
+	}else if (dist2 < photons[num_index-1].dist2) {
 
-		    photons[num_index-1] = node->data;
-		    photons[num_index-1].distance = tmp_distance;
-		    sort(photons, photons+num_index, sort_distance);
-			
-		}
+		photons[num_index-1].photon = photon;
+		photons[num_index-1].dist2 = dist2;
+		sort(photons, photons+num_index, sort_distance);
+	}
+}
 
-		return;
+void KDtree::find_node(Vector3 pt, NearPhoton photons[], size_t dim, int &num_index, int start, int end) {
+	
+	bool left_flag;
+	int num = start + (end-start)/2;
+	const Photon& node = map[num];
+	bool has_left = num > start;
+	bool has_right = num < end;
+	
+	real_t dx = pt.x - node.position[0];
+	real_t dy = pt.y - node.position[1];
+	real_t dz = pt.z - node.position[2];
+	real_t tmp_dist2 = dx*dx + dy*dy + dz*dz;
+	// go back when reaching leave node
+	if (!has_left && !has_right) {
+		
+	    // store photon to array
+	    add_near_photon(photons, num_index, num_full, &node, tmp_dist2);
+	    return;
 
-	}else if (node->left!=NULL && node->right==NULL) {
+	}else if (has_left && !has_right) {
 
     	    left_flag = true;
-	    find_node(pt, photons, dim+1, num_index, node->left);
+	    find_node(pt, photons, dim+1, num_index, start, num-1);
 
-	}else if (node->right!=NULL && node->left==NULL) {
+	}else if (has_right && !has_left) {
 
     	    left_flag = false;
-	    find_node(pt, photons, dim+1, num_index, node->right);
+	    find_node(pt, photons, dim+1, num_index, num+1, end);
 
 	}else {
 
 	    // recursively go to next node
+	    real_t split_dis;
 	    switch (dim%3) {
 		case 0: 
-		    if (pt.x<node->data.position.x) {
-			left_flag = true;
-			find_node(pt, photons, dim+1, num_index, node->left);
-		    }else {
-			left_flag = false;
-			find_node(pt, photons, dim+1, num_index, node->right);
-		    }
+		    split_dis = dx;
 		    break;
 		case 1: 
-		    if (pt.y<node->data.position.y) {
-			left_flag = true;
-			find_node(pt, photons, dim+1, num_index, node->left);
-		    }else {
-			left_flag = false;
-			find_node(pt, photons, dim+1, num_index, node->right);
-		    }
+		    split_dis = dy;
 		    break;
-		case 2:	
-		    if (pt.z<node->data.position.z) {
-			left_flag = true;
-			find_node(pt, photons, dim+1, num_index, node->left);
-		    }else {
-			left_flag = false;
-			find_node(pt, photons, dim+1, num_index, node->right);
-		    }
+		default:
+		    split_dis = dz;
 		    break;
-		}
+	    }
+	    if (split_dis<0) {
+		left_flag = true;
+		find_node(pt, photons, dim+1, num_index, start, num-1);
+	    }else {
+		left_flag = false;
+		find_node(pt, photons, dim+1, num_index, num+1, end);
+	    }
 	}
 
 	// decide to go to the other branch 
@@ -209,60 +329,148 @@ void KDtree::find_node(Vector3 pt, Photon photons[], size_t dim, int &num_index,
 	switch (dim%3) {
 	
 	    case 0: 
-		nearest_dis = abs(pt.x - node->data.position.x);
+		nearest_dis = dx;
 		break;
 	    case 1:
-		nearest_dis = abs(pt.y - node->data.position.y);	
+		nearest_dis = dy;
 		break;
-	    case 2:
-		nearest_dis = abs(pt.z - node->data.position.z);
+	    default:
+		nearest_dis = dz;
 		break;
 	}
 
 
-	if ( (num_index < num_full) || (nearest_dis < photons[num_index-1].distance) ) {
+	if ( (num_index < num_full) || (nearest_dis*nearest_dis < photons[num_index-1].dist2) ) {
 
 		// go to the other branch
 		if (left_flag==true) {
-			if (node->right!=NULL) {
-				find_node(pt, photons, dim+1, num_index, node->right);
+			if (has_right) {
+				find_node(pt, photons, dim+1, num_index, num+1, end);
 			}
 		}else {
-			if (node->left!=NULL) {
-				find_node(pt, photons, dim+1, num_index, node->left);	
+			if (has_left) {
+				find_node(pt, photons, dim+1, num_index, start, num-1);	
 			}
 		}
 
 		// store photons after visiting the other branch
-		if (num_index < num_full ) {
-
-			photons[num_index] = node->data;
-			photons[num_index].distance = tmp_distance;
-			num_index++;
-			sort(photons, photons+num_index, sort_distance);
-
-		//if the array is full.
-		}else if (tmp_distance<photons[num_index-1].distance) {
-			
-			photons[num_index-1] = node->data;
-			photons[num_index-1].distance = tmp_distance;
-			sort(photons, photons+num_index, sort_distance);
-			
-		}
+		add_near_photon(photons, num_index, num_full, &node, tmp_dist2);
 		return;
 	}else {
 		return;
 	}
 
+}
 
+// Nearest photon within sqrt(max_dist2) of pt whose normal is within
+// acos(min_cos) of the given normal, or NULL. Used for the precomputed
+// irradiance lookups, which only need a single neighbour.
+const Photon* KDtree::find_nearest(Vector3 pt, Vector3 normal, real_t max_dist2, real_t min_cos) {
 
+	const Photon* best = NULL;
+	real_t best_dist2 = max_dist2;
+	if (num_map > 0) {
+		find_nearest_node(pt, normal, min_cos, 0, 0, num_map-1, best, best_dist2);
+	}
+	return best;
 }
 
+void KDtree::find_nearest_node(Vector3 pt, Vector3 normal, real_t min_cos, size_t dim, int start, int end,
+                               const Photon* &best, real_t &best_dist2) {
 
+	int num = start + (end-start)/2;
+	const Photon& node = map[num];
 
+	real_t dx = pt.x - node.position[0];
+	real_t dy = pt.y - node.position[1];
+	real_t dz = pt.z - node.position[2];
+	real_t split_dis;
+	switch (dim%3) {
+	    case 0:
+		split_dis = dx;
+		break;
+	    case 1:
+		split_dis = dy;
+		break;
+	    default:
+		split_dis = dz;
+		break;
+	}
 
-	
+	// near side first, so the far side can usually be skipped
+	if (split_dis < 0) {
+		if (num > start) {
+			find_nearest_node(pt, normal, min_cos, dim+1, start, num-1, best, best_dist2);
+		}
+	}else if (num < end) {
+		find_nearest_node(pt, normal, min_cos, dim+1, num+1, end, best, best_dist2);
+	}
 
+	real_t dist2 = dx*dx + dy*dy + dz*dz;
+	if (dist2 < best_dist2 && dot(node.get_normal(), normal) >= min_cos) {
+		best = &node;
+		best_dist2 = dist2;
+	}
 
+	if (split_dis*split_dis < best_dist2) {
+		if (split_dis < 0) {
+			if (num < end) {
+				find_nearest_node(pt, normal, min_cos, dim+1, num+1, end, best, best_dist2);
+			}
+		}else if (num > start) {
+			find_nearest_node(pt, normal, min_cos, dim+1, start, num-1, best, best_dist2);
+		}
+	}
+}
+
+// Fixed radius gather: adds up power*cos of every photon within
+// sqrt(radius2) of pt that arrives on the side the normal faces.
+void KDtree::gather(Vector3 pt, Vector3 normal, real_t radius2, Color3 &flux, size_t &count) {
+
+	flux = Color3(0.0, 0.0, 0.0);
+	count = 0;
+	if (num_map > 0) {
+		gather_node(pt, normal, radius2, 0, 0, num_map-1, flux, count);
+	}
+}
+
+void KDtree::gather_node(Vector3 pt, Vector3 normal, real_t radius2, size_t dim, int start, int end,
+                         Color3 &flux, size_t &count) {
+
+	int num = start + (end-start)/2;
+	const Photon& node = map[num];
+
+	real_t dx = pt.x - node.position[0];
+	real_t dy = pt.y - node.position[1];
+	real_t dz = pt.z - node.position[2];
+	real_t split_dis;
+	switch (dim%3) {
+	    case 0:
+		split_dis = dx;
+		break;
+	    case 1:
+		split_dis = dy;
+		break;
+	    default:
+		split_dis = dz;
+		break;
+	}
+
+	if (dx*dx + dy*dy + dz*dz < radius2) {
+		real_t cos_in = -dot(node.get_direction(), normal);
+		if (cos_in > 0) {
+			flux += node.get_power()*cos_in;
+			count++;
+		}
+	}
+
+	// the left subtree lies below the split plane, the right one above it
+	if (num > start && (split_dis < 0 || split_dis*split_dis < radius2)) {
+		gather_node(pt, normal, radius2, dim+1, start, num-1, flux, count);
+	}
+	if (num < end && (split_dis >= 0 || split_dis*split_dis < radius2)) {
+		gather_node(pt, normal, radius2, dim+1, num+1, end, flux, count);
+	}
+}
 
 }
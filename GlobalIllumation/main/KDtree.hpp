@@ -11,39 +11,80 @@
 namespace _462 {
 
 
+/*
+ * A stored photon, packed into 20 bytes so that large maps stay in cache
+ * (the old layout with double position/colors was ~88 bytes). The power is
+ * kept in Ward's shared-exponent RGBE format and the incident direction and
+ * surface normal are quantized to pairs of spherical angles, as in Jensen's
+ * photon maps.
+ *
+ * The same record holds precomputed irradiance estimates, in which case
+ * power is the irradiance at the photon position.
+ */
 struct Photon {
-    
-    //Vector3 direction;
-    Vector3 position;
-    Color3 intensity;
-    Color3 materialColor;
-    real_t distance;
-    real_t dTimesn;
 
+	float position[3];
+	unsigned char power[4];		// RGBE, exponent in power[3]
+	unsigned char theta, phi;	// quantized incident direction
+	unsigned char ntheta, nphi;	// quantized surface normal, lit side
+
+	void set_position(const Vector3& p);
+	Vector3 get_position() const;
+	void set_power(const Color3& c);
+	Color3 get_power() const;
+	void set_direction(const Vector3& d);
+	Vector3 get_direction() const;
+	void set_normal(const Vector3& n);
+	Vector3 get_normal() const;
 };
 
-struct Node {
-	Node* left;
-	Node* right;
-	Photon data;
+// scratch record for the k nearest photons, only lives during a lookup
+struct NearPhoton {
+	const Photon* photon;
+	real_t dist2;
 };
 
+/*
+ * Common interface of the photon lookup structures, so that the fixed
+ * radius gathers can run on either a KDtree or a PhotonHashGrid.
+ */
+class PhotonMap {
+public:
+
+	virtual ~PhotonMap() { }
+	// takes over num photons of map, no gather will use a larger radius2
+	virtual void build(Photon map[], size_t num, real_t max_radius2) = 0;
+	virtual void gather(Vector3 pt, Vector3 normal, real_t radius2, Color3 &flux, size_t &count) = 0;
+};
 
-class KDtree {
+/*
+ * Balanced kd-tree stored implicitly in the photon array: the photons of a
+ * subtree occupy a contiguous range, its root is the middle element and the
+ * split axis cycles x, y, z with depth. Since there are no pointers, a built
+ * map can be written to disk and mapped back in as is.
+ */
+class KDtree : public PhotonMap {
 public:
 
 	size_t num_map;
 	int num_full;
-	Node* root;
 	Photon* map;
 
 	KDtree();
 	~KDtree();
 	void insert_list(Photon map[]);
-	Node* preorder_insert_node(Node* node, int start, int end, size_t dim_index);
-	Color3 calculate_color(Vector3 pt, size_t photon_num);
-	void traverse_node(Node* node, size_t index);
-	void find_node(Vector3 pt, Photon photons[], size_t dim, int &num_index, Node* node);
+	void set_list(Photon map[]);
+	void build(Photon map[], size_t num, real_t max_radius2);
+	void preorder_insert_node(int start, int end, size_t dim_index);
+	Color3 calculate_irradiance(Vector3 pt, Vector3 normal, size_t photon_num, real_t* radius2 = NULL);
+	Color3 calculate_color(Vector3 pt, Vector3 normal, Color3 diffuse, size_t photon_num);
+	void find_node(Vector3 pt, NearPhoton photons[], size_t dim, int &num_index, int start, int end);
+	void gather(Vector3 pt, Vector3 normal, real_t radius2, Color3 &flux, size_t &count);
+	void gather_node(Vector3 pt, Vector3 normal, real_t radius2, size_t dim, int start, int end,
+	                 Color3 &flux, size_t &count);
+	const Photon* find_nearest(Vector3 pt, Vector3 normal, real_t max_dist2, real_t min_cos);
+	void find_nearest_node(Vector3 pt, Vector3 normal, real_t min_cos, size_t dim, int start, int end,
+	                       const Photon* &best, real_t &best_dist2);
 
 };
 
@@ -0,0 +1,165 @@
+/**
+ * @file denoiser.cpp
+ * @brief Edge-avoiding filter for low sample count renders.
+ */
+
+#include "denoiser.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace _462 {
+
+static inline real_t luminance(const Color3& c)
+{
+    return 0.2126*c.r + 0.7152*c.g + 0.0722*c.b;
+}
+
+PixelFeatures::PixelFeatures()
+    : albedo(0, 0, 0), normal(0, 0, 0), depth(0),
+      luminance(0), luminance2(0), num_samples(0) { }
+
+void PixelFeatures::add_sample(const Color3& color, const Color3& albedo,
+                               const Vector3& normal, real_t depth)
+{
+    real_t l = _462::luminance(color);
+    this->albedo += albedo;
+    this->normal += normal;
+    this->depth += depth;
+    luminance += l;
+    luminance2 += l*l;
+    num_samples++;
+}
+
+void Denoiser::resize(size_t width, size_t height)
+{
+    this->width = width;
+    this->height = height;
+    albedo.assign(width*height, Color3(0, 0, 0));
+    normal.assign(width*height, Vector3(0, 0, 0));
+    depth.assign(width*height, 0);
+    variance.assign(width*height, 0);
+}
+
+void Denoiser::set_pixel(size_t pixel, const PixelFeatures& features)
+{
+    size_t n = features.num_samples;
+    if (n == 0) {
+        return;
+    }
+    real_t inv_n = real_t(1)/n;
+    albedo[pixel] = features.albedo*inv_n;
+    real_t len = length(features.normal);
+    normal[pixel] = len > 0 ? features.normal*(1/len) : Vector3(0, 0, 0);
+    depth[pixel] = features.depth*inv_n;
+
+    // variance of the mean; a single sample is taken to be all noise
+    real_t mean = features.luminance*inv_n;
+    if (n > 1) {
+        real_t sample_variance = (features.luminance2 - n*mean*mean)/(n - 1);
+        variance[pixel] = std::max(real_t(0), sample_variance)*inv_n;
+    } else {
+        variance[pixel] = mean*mean;
+    }
+}
+
+static const real_t KERNEL[5] = { 1.0/16, 1.0/4, 3.0/8, 1.0/4, 1.0/16 };
+
+void Denoiser::denoise(Color3* image) const
+{
+    int w = (int)width;
+    int h = (int)height;
+    std::vector<Color3> color(image, image + width*height);
+    std::vector<Color3> next(width*height);
+    std::vector<real_t> var(variance);
+    std::vector<real_t> next_var(width*height);
+    std::vector<real_t> blurred_var(width*height);
+
+    for (int iteration = 0; iteration < DENOISE_ITERATIONS; iteration++) {
+        int step = 1 << iteration;
+
+        // the noise estimate steering the luminance weights is blurred
+        // once more, it is too noisy itself at low sample counts
+#pragma omp parallel for
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                real_t sum = 0;
+                real_t weight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int qx = x + dx;
+                        int qy = y + dy;
+                        if (qx >= 0 && qx < w && qy >= 0 && qy < h) {
+                            real_t k = KERNEL[2*dx + 2]*KERNEL[2*dy + 2];
+                            sum += k*var[qy*w + qx];
+                            weight += k;
+                        }
+                    }
+                }
+                blurred_var[y*w + x] = sum/weight;
+            }
+        }
+
+#pragma omp parallel for
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                int p = y*w + x;
+                // nothing was hit, the background is noise free
+                if (squared_length(normal[p]) == 0) {
+                    next[p] = color[p];
+                    next_var[p] = var[p];
+                    continue;
+                }
+
+                real_t lp = luminance(color[p]);
+                real_t sigma_l = DENOISE_SIGMA_LUMINANCE*sqrt(blurred_var[p]) + 1e-6;
+                real_t sigma_z = DENOISE_SIGMA_DEPTH*depth[p]*step + 1e-6;
+                Color3 sum(0, 0, 0);
+                real_t sum_var = 0;
+                real_t weight = 0;
+
+                for (int dy = -2; dy <= 2; dy++) {
+                    int qy = y + dy*step;
+                    if (qy < 0 || qy >= h) {
+                        continue;
+                    }
+                    for (int dx = -2; dx <= 2; dx++) {
+                        int qx = x + dx*step;
+                        if (qx < 0 || qx >= w) {
+                            continue;
+                        }
+                        int q = qy*w + qx;
+
+                        real_t cos_n = dot(normal[p], normal[q]);
+                        if (cos_n <= 0) {
+                            continue;
+                        }
+                        real_t ar = albedo[p].r - albedo[q].r;
+                        real_t ag = albedo[p].g - albedo[q].g;
+                        real_t ab = albedo[p].b - albedo[q].b;
+                        real_t d2 = ar*ar + ag*ag + ab*ab;
+                        real_t k = KERNEL[dx + 2]*KERNEL[dy + 2]
+                                   *pow(cos_n, real_t(DENOISE_SIGMA_NORMAL))
+                                   *exp(-fabs(depth[p] - depth[q])/sigma_z
+                                        - d2/(DENOISE_SIGMA_ALBEDO*DENOISE_SIGMA_ALBEDO)
+                                        - fabs(lp - luminance(color[q]))/sigma_l);
+                        sum += color[q]*k;
+                        sum_var += k*k*var[q];
+                        weight += k;
+                    }
+                }
+
+                // the center always has weight KERNEL[2]^2
+                next[p] = sum*(1/weight);
+                next_var[p] = sum_var/(weight*weight);
+            }
+        }
+
+        color.swap(next);
+        var.swap(next_var);
+    }
+
+    std::copy(color.begin(), color.end(), image);
+}
+
+} /* _462 */
@@ -0,0 +1,65 @@
+/**
+ * @file denoiser.hpp
+ * @brief Edge-avoiding filter for low sample count renders.
+ */
+
+#ifndef _462_DENOISER_HPP_
+#define _462_DENOISER_HPP_
+
+#include "math/color.hpp"
+#include "math/vector.hpp"
+
+#include <vector>
+
+namespace _462 {
+
+#define DENOISE_ITERATIONS 5
+#define DENOISE_SIGMA_LUMINANCE 4.0
+#define DENOISE_SIGMA_NORMAL 128.0
+#define DENOISE_SIGMA_DEPTH 0.02
+#define DENOISE_SIGMA_ALBEDO 0.1
+
+// running sums over the samples of one pixel, for the denoiser
+struct PixelFeatures {
+    Color3 albedo;
+    Vector3 normal;
+    real_t depth;
+    real_t luminance;
+    real_t luminance2;
+    size_t num_samples;
+
+    PixelFeatures();
+
+    // a sample that hit nothing has a zero normal
+    void add_sample(const Color3& color, const Color3& albedo, const Vector3& normal, real_t depth);
+};
+
+/*
+ * Dammertz et al.'s edge-avoiding a-trous wavelet filter. Each iteration
+ * is a 5x5 B3 spline blur with holes of 2^i pixels, where a neighbour is
+ * weighted down as its normal, depth or albedo differ from the center, or
+ * its luminance differs by more than the per pixel noise predicts. The
+ * noise estimate is filtered along with the color, as in SVGF, so later
+ * iterations blur less.
+ */
+class Denoiser {
+public:
+
+    void resize(size_t width, size_t height);
+    void set_pixel(size_t pixel, const PixelFeatures& features);
+    // filters image, which is width*height row-major pixels, in place
+    void denoise(Color3* image) const;
+
+private:
+
+    size_t width, height;
+    std::vector<Color3> albedo;
+    std::vector<Vector3> normal;
+    std::vector<real_t> depth;
+    // variance of the luminance of the pixel estimate
+    std::vector<real_t> variance;
+};
+
+} /* _462 */
+
+#endif /* _462_DENOISER_HPP_ */
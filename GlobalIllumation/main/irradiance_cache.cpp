@@ -0,0 +1,230 @@
+/**
+ * @file irradiance_cache.cpp
+ * @brief Ward-style irradiance cache for the diffuse indirect term.
+ */
+
+#include "irradiance_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+namespace _462 {
+
+IrradianceCache::Node::Node(const Vector3& c, real_t h)
+    : center(c), half_size(h), entries(NULL)
+{
+    for (int i = 0; i < 8; i++) {
+        children[i].store(NULL);
+    }
+}
+
+IrradianceCache::Node::~Node()
+{
+    Entry* e = entries.load();
+    while (e) {
+        Entry* next = e->next;
+        delete e;
+        e = next;
+    }
+    for (int i = 0; i < 8; i++) {
+        delete children[i].load();
+    }
+}
+
+IrradianceCache::IrradianceCache()
+    : root(NULL), accuracy(0.5) { }
+
+IrradianceCache::~IrradianceCache()
+{
+    clear();
+}
+
+void IrradianceCache::clear()
+{
+    delete root;
+    root = NULL;
+    for (size_t i = 0; i < records.size(); i++) {
+        delete records[i];
+    }
+    records.clear();
+}
+
+void IrradianceCache::reset(const Vector3& min, const Vector3& max, real_t accuracy)
+{
+    clear();
+    Vector3 extent = max - min;
+    real_t half_size = 0.5*std::max(extent.x, std::max(extent.y, extent.z));
+    root = new Node((min + max)*0.5, half_size*1.01);
+    this->accuracy = accuracy;
+}
+
+size_t IrradianceCache::size() const
+{
+    std::lock_guard<std::mutex> guard(insert_lock);
+    return records.size();
+}
+
+/*
+ * Ward's interpolation: record i contributes with weight
+ *     w = 1 / (|x - x_i|/R_i + sqrt(1 - n.n_i))
+ * if w > 1/accuracy and x is not in front of it.
+ */
+bool IrradianceCache::lookup(const Vector3& pt, const Vector3& normal, Color3& irradiance) const
+{
+    if (!root) {
+        return false;
+    }
+
+    Color3 sum(0.0, 0.0, 0.0);
+    real_t weight_sum = 0;
+    real_t min_weight = 1.0/accuracy;
+
+    const Node* node = root;
+    while (node) {
+        for (const Entry* e = node->entries.load(std::memory_order_acquire); e; e = e->next) {
+            const IrradianceRecord* rec = e->record;
+
+            real_t cos_n = dot(normal, rec->normal);
+            if (cos_n <= 0) {
+                continue;
+            }
+            // records behind the point in the normal direction do not apply
+            Vector3 offset = pt - rec->position;
+            if (dot(offset, (normal + rec->normal)*0.5) < -0.01*rec->radius) {
+                continue;
+            }
+            real_t err = length(offset)/rec->radius + sqrt(std::max(real_t(0), 1 - cos_n));
+            if (err*min_weight >= 1) {
+                continue;
+            }
+            real_t w = err > 1e-6 ? 1/err : 1e6;
+            sum += rec->irradiance*w;
+            weight_sum += w;
+        }
+
+        int child = (pt.x > node->center.x ? 1 : 0)
+                  | (pt.y > node->center.y ? 2 : 0)
+                  | (pt.z > node->center.z ? 4 : 0);
+        node = node->children[child].load(std::memory_order_acquire);
+    }
+
+    if (weight_sum <= 0) {
+        return false;
+    }
+    irradiance = sum*(1/weight_sum);
+    return true;
+}
+
+void IrradianceCache::insert(const Vector3& pt, const Vector3& normal,
+                             const Color3& irradiance, real_t radius)
+{
+    if (!root || radius <= 0) {
+        return;
+    }
+
+    IrradianceRecord* rec = new IrradianceRecord;
+    rec->position = pt;
+    rec->normal = normal;
+    rec->irradiance = irradiance;
+    rec->radius = radius;
+
+    // the record is usable up to accuracy*radius away
+    real_t extent = accuracy*radius;
+    Vector3 ext(extent, extent, extent);
+
+    std::lock_guard<std::mutex> guard(insert_lock);
+    records.push_back(rec);
+    add(root, 0, rec, pt - ext, pt + ext);
+}
+
+// links record into every node of the right size that its box overlaps
+void IrradianceCache::add(Node* node, size_t depth, const IrradianceRecord* record,
+                          const Vector3& min, const Vector3& max)
+{
+    real_t extent = 0.5*(max.x - min.x);
+    bool inside = min.x >= node->center.x - node->half_size && max.x <= node->center.x + node->half_size
+               && min.y >= node->center.y - node->half_size && max.y <= node->center.y + node->half_size
+               && min.z >= node->center.z - node->half_size && max.z <= node->center.z + node->half_size;
+
+    // stop once the children would be smaller than the record, and keep
+    // records sticking out of the root at the root so lookups still see them
+    if (node->half_size < 2*extent || depth >= IRRADIANCE_CACHE_MAX_DEPTH
+        || (depth == 0 && !inside)) {
+        Entry* e = new Entry;
+        e->record = record;
+        e->next = node->entries.load(std::memory_order_relaxed);
+        node->entries.store(e, std::memory_order_release);
+        return;
+    }
+
+    real_t h = 0.5*node->half_size;
+    for (int i = 0; i < 8; i++) {
+        Vector3 c(node->center.x + ((i & 1) ? h : -h),
+                  node->center.y + ((i & 2) ? h : -h),
+                  node->center.z + ((i & 4) ? h : -h));
+        if (max.x < c.x - h || min.x > c.x + h ||
+            max.y < c.y - h || min.y > c.y + h ||
+            max.z < c.z - h || min.z > c.z + h) {
+            continue;
+        }
+        Node* child = node->children[i].load(std::memory_order_relaxed);
+        if (!child) {
+            child = new Node(c, h);
+            node->children[i].store(child, std::memory_order_release);
+        }
+        add(child, depth + 1, record, min, max);
+    }
+}
+
+/*
+ * Cache file layout: magic, scene hash, record count, then the records.
+ * The octree is rebuilt on load.
+ */
+static const char IRRADIANCE_CACHE_MAGIC[8] = { 'I', 'R', 'R', 'C', 'A', 'C', 'H', '1' };
+
+bool IrradianceCache::save(const char* filename, unsigned long long hash) const
+{
+    std::lock_guard<std::mutex> guard(insert_lock);
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    unsigned long long count = records.size();
+    bool ok = fwrite(IRRADIANCE_CACHE_MAGIC, sizeof IRRADIANCE_CACHE_MAGIC, 1, file) == 1
+           && fwrite(&hash, sizeof hash, 1, file) == 1
+           && fwrite(&count, sizeof count, 1, file) == 1;
+    for (size_t i = 0; ok && i < records.size(); i++) {
+        ok = fwrite(records[i], sizeof(IrradianceRecord), 1, file) == 1;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+// adds the records of a cache file saved for the same scene
+bool IrradianceCache::load(const char* filename, unsigned long long hash)
+{
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return false;
+    }
+
+    char magic[8];
+    unsigned long long file_hash, count;
+    bool ok = fread(magic, sizeof magic, 1, file) == 1
+           && memcmp(magic, IRRADIANCE_CACHE_MAGIC, sizeof magic) == 0
+           && fread(&file_hash, sizeof file_hash, 1, file) == 1
+           && file_hash == hash
+           && fread(&count, sizeof count, 1, file) == 1;
+
+    for (unsigned long long i = 0; ok && i < count; i++) {
+        IrradianceRecord rec;
+        ok = fread(&rec, sizeof rec, 1, file) == 1;
+        if (ok) {
+            insert(rec.position, rec.normal, rec.irradiance, rec.radius);
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+} /* _462 */
@@ -0,0 +1,90 @@
+/**
+ * @file irradiance_cache.hpp
+ * @brief Ward-style irradiance cache for the diffuse indirect term.
+ */
+
+#ifndef _462_IRRADIANCE_CACHE_HPP_
+#define _462_IRRADIANCE_CACHE_HPP_
+
+#include "math/color.hpp"
+#include "math/vector.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace _462 {
+
+#define IRRADIANCE_CACHE_MAX_DEPTH 16
+
+// a cached irradiance value, valid within radius of position
+struct IrradianceRecord {
+    Vector3 position;
+    Vector3 normal;
+    Color3 irradiance;
+    real_t radius;
+};
+
+/*
+ * Octree of irradiance records. A record is linked into every node at the
+ * level matching its extent that it overlaps, so a lookup only walks the
+ * path from the root to the leaf containing the query point.
+ *
+ * Lookups never lock: nodes and records are immutable once published, and
+ * inserts publish them with release stores under a single mutex. This lets
+ * the render threads fill the cache lazily while others read it.
+ */
+class IrradianceCache {
+public:
+
+    IrradianceCache();
+    ~IrradianceCache();
+
+    // drops all records and restarts with the given bounds
+    void reset(const Vector3& min, const Vector3& max, real_t accuracy);
+
+    // interpolates the records valid at pt, false if there are none
+    bool lookup(const Vector3& pt, const Vector3& normal, Color3& irradiance) const;
+    void insert(const Vector3& pt, const Vector3& normal,
+                const Color3& irradiance, real_t radius);
+
+    size_t size() const;
+
+    bool save(const char* filename, unsigned long long hash) const;
+    bool load(const char* filename, unsigned long long hash);
+
+private:
+
+    struct Entry {
+        const IrradianceRecord* record;
+        Entry* next;
+    };
+
+    struct Node {
+        Vector3 center;
+        real_t half_size;
+        std::atomic<Entry*> entries;
+        std::atomic<Node*> children[8];
+
+        Node(const Vector3& c, real_t h);
+        ~Node();
+    };
+
+    void add(Node* node, size_t depth, const IrradianceRecord* record,
+             const Vector3& min, const Vector3& max);
+    void clear();
+
+    Node* root;
+    real_t accuracy;
+    // every record ever inserted, in insertion order, for saving and freeing
+    std::vector<IrradianceRecord*> records;
+    mutable std::mutex insert_lock;
+
+    // no meaningful copy
+    IrradianceCache(const IrradianceCache&);
+    IrradianceCache& operator=(const IrradianceCache&);
+};
+
+} /* _462 */
+
+#endif /* _462_IRRADIANCE_CACHE_HPP_ */
@@ -0,0 +1,214 @@
+/**
+ * @file light_bvh.cpp
+ * @brief Light hierarchy for sampling one of many lights.
+ */
+
+#include "light_bvh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace _462 {
+
+static const real_t ONE_MINUS_EPSILON = 1 - std::numeric_limits<real_t>::epsilon()/2;
+
+LightBVH::LightBVH()
+    : lights(NULL) { }
+
+void LightBVH::build(const SphereLight* lights, size_t num_lights)
+{
+    this->lights = lights;
+    nodes.clear();
+    if (num_lights == 0) {
+        return;
+    }
+    std::vector<size_t> order(num_lights);
+    for (size_t i = 0; i < num_lights; i++) {
+        order[i] = i;
+    }
+    nodes.reserve(2*num_lights - 1);
+    build_node(order, 0, num_lights);
+}
+
+// sorts lights along one axis by position
+struct LightAxisLess {
+    const SphereLight* lights;
+    int axis;
+    bool operator()(size_t a, size_t b) const {
+        return lights[a].position[axis] < lights[b].position[axis];
+    }
+};
+
+static inline real_t angle_between(const Vector3& a, const Vector3& b)
+{
+    return acos(clamp(dot(a, b), real_t(-1), real_t(1)));
+}
+
+// smallest cone holding both cones, after Conty and Kulla
+static void merge_cones(Vector3 axis_a, real_t cos_a, Vector3 axis_b, real_t cos_b,
+                        Vector3 &axis, real_t &cos_theta_o)
+{
+    real_t theta_a = acos(cos_a);
+    real_t theta_b = acos(cos_b);
+    if (theta_a < theta_b) {
+        std::swap(axis_a, axis_b);
+        std::swap(theta_a, theta_b);
+    }
+    axis = axis_a;
+    cos_theta_o = cos(theta_a);
+
+    real_t theta_d = angle_between(axis_a, axis_b);
+    if (std::min(theta_d + theta_b, real_t(PI)) <= theta_a) {
+        return;
+    }
+    real_t theta_o = 0.5*(theta_a + theta_d + theta_b);
+    if (theta_o >= PI) {
+        cos_theta_o = -1;
+        return;
+    }
+    // turn axis_a toward axis_b until the cone reaches around both
+    Vector3 perp = normalize(axis_b - axis_a*dot(axis_a, axis_b));
+    real_t turn = theta_o - theta_a;
+    axis = normalize(axis_a*cos(turn) + perp*sin(turn));
+    cos_theta_o = cos(theta_o);
+}
+
+int LightBVH::build_node(std::vector<size_t>& order, size_t begin, size_t end)
+{
+    int index = (int)nodes.size();
+    nodes.push_back(Node());
+
+    if (end - begin == 1) {
+        const SphereLight& light = lights[order[begin]];
+        Node& node = nodes[index];
+        Vector3 r(light.radius, light.radius, light.radius);
+        node.min = light.position - r;
+        node.max = light.position + r;
+        node.power = light.color.r + light.color.g + light.color.b;
+        node.constant = light.attenuation.constant;
+        node.linear = light.attenuation.linear;
+        node.quadratic = light.attenuation.quadratic;
+        // sphere lights shine in all directions
+        node.axis = Vector3(0, 0, 1);
+        node.cos_theta_o = -1;
+        node.left = node.right = -1;
+        node.light = order[begin];
+        return index;
+    }
+
+    // split at the median along the longest extent of the light positions
+    Vector3 min = lights[order[begin]].position;
+    Vector3 max = min;
+    for (size_t i = begin + 1; i < end; i++) {
+        min = vmin(min, lights[order[i]].position);
+        max = vmax(max, lights[order[i]].position);
+    }
+    Vector3 extent = max - min;
+    LightAxisLess less;
+    less.lights = lights;
+    less.axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    size_t mid = begin + (end - begin)/2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, less);
+
+    int left = build_node(order, begin, mid);
+    int right = build_node(order, mid, end);
+
+    const Node& a = nodes[left];
+    const Node& b = nodes[right];
+    Node node;
+    node.min = vmin(a.min, b.min);
+    node.max = vmax(a.max, b.max);
+    node.power = a.power + b.power;
+    node.constant = std::min(a.constant, b.constant);
+    node.linear = std::min(a.linear, b.linear);
+    node.quadratic = std::min(a.quadratic, b.quadratic);
+    merge_cones(a.axis, a.cos_theta_o, b.axis, b.cos_theta_o, node.axis, node.cos_theta_o);
+    node.left = left;
+    node.right = right;
+    node.light = 0;
+    nodes[index] = node;
+    return index;
+}
+
+/*
+ * Upper estimate of the light a node sends to pt: its power, times the
+ * cosine at the surface and at the emitter for the most favorable
+ * direction into the node's bounding sphere, over the attenuation at the
+ * distance of its center. Zero only if no light of the node can reach pt
+ * from above the surface.
+ */
+real_t LightBVH::importance(const Node& node, const Vector3& pt, const Vector3& normal) const
+{
+    Vector3 center = (node.min + node.max)*0.5;
+    real_t radius = 0.5*distance(node.min, node.max);
+    Vector3 v = pt - center;
+    real_t dist = length(v);
+
+    real_t cos_i = 1;
+    real_t emission = 1;
+    if (dist > radius) {
+        Vector3 w = v*(1/dist);
+        real_t theta_u = asin(radius/dist);
+
+        real_t theta_i = std::max(real_t(0), angle_between(normal, -w) - theta_u);
+        if (theta_i >= 0.5*PI) {
+            return 0;
+        }
+        cos_i = cos(theta_i);
+
+        if (node.cos_theta_o > -1) {
+            real_t theta = angle_between(node.axis, w) - acos(node.cos_theta_o) - theta_u;
+            if (theta >= 0.5*PI) {
+                return 0;
+            }
+            emission = theta > 0 ? cos(theta) : 1;
+        }
+    }
+
+    real_t d = std::max(dist, radius);
+    real_t attenuation = node.constant + node.linear*d + node.quadratic*d*d;
+    if (attenuation <= 0) {
+        attenuation = 1;
+    }
+    return node.power*cos_i*emission/attenuation;
+}
+
+bool LightBVH::sample(const Vector3& pt, const Vector3& normal, real_t u,
+                      size_t &light, real_t &pdf) const
+{
+    if (nodes.empty() || importance(nodes[0], pt, normal) <= 0) {
+        return false;
+    }
+
+    pdf = 1;
+    int index = 0;
+    while (nodes[index].left >= 0) {
+        const Node& node = nodes[index];
+        real_t left = importance(nodes[node.left], pt, normal);
+        real_t right = importance(nodes[node.right], pt, normal);
+        if (left + right <= 0) {
+            return false;
+        }
+
+        // reuse u for the next level. A child without importance is never
+        // picked, and the rescaled u is kept below 1 in case it rounds up.
+        real_t p = left/(left + right);
+        if (right <= 0 || (left > 0 && u < p)) {
+            index = node.left;
+            pdf *= p;
+            u = std::min(u/p, ONE_MINUS_EPSILON);
+        } else {
+            index = node.right;
+            pdf *= 1 - p;
+            u = std::min((u - p)/(1 - p), ONE_MINUS_EPSILON);
+        }
+    }
+    if (pdf <= 0) {
+        return false;
+    }
+    light = nodes[index].light;
+    return true;
+}
+
+} /* _462 */
@@ -0,0 +1,59 @@
+/**
+ * @file light_bvh.hpp
+ * @brief Light hierarchy for sampling one of many lights.
+ */
+
+#ifndef _462_LIGHT_BVH_HPP_
+#define _462_LIGHT_BVH_HPP_
+
+#include "scene/scene.hpp"
+
+#include <vector>
+
+namespace _462 {
+
+/*
+ * Bounding volume hierarchy over the lights, after Conty and Kulla's
+ * light trees. Every node bounds the position, total power, attenuation
+ * and emission directions (a cone) of its lights. Sampling walks from the
+ * root and picks a child with probability proportional to a conservative
+ * estimate of how much it can light the shading point, so the cost is
+ * O(log n) in the number of lights.
+ */
+class LightBVH {
+public:
+
+    LightBVH();
+
+    void build(const SphereLight* lights, size_t num_lights);
+
+    // picks a light for shading pt with the given normal, u uniform in
+    // [0, 1). false if no light can reach pt.
+    bool sample(const Vector3& pt, const Vector3& normal, real_t u,
+                size_t &light, real_t &pdf) const;
+
+private:
+
+    struct Node {
+        Vector3 min, max;
+        real_t power;
+        // weakest attenuation of the lights below
+        real_t constant, linear, quadratic;
+        // emission directions within acos(cos_theta_o) of axis
+        Vector3 axis;
+        real_t cos_theta_o;
+        // children, or the light of a leaf if left < 0
+        int left, right;
+        size_t light;
+    };
+
+    int build_node(std::vector<size_t>& order, size_t begin, size_t end);
+    real_t importance(const Node& node, const Vector3& pt, const Vector3& normal) const;
+
+    std::vector<Node> nodes;
+    const SphereLight* lights;
+};
+
+} /* _462 */
+
+#endif /* _462_LIGHT_BVH_HPP_ */
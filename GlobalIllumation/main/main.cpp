@@ -52,6 +52,8 @@ struct Options
     // window dimensions
     int width, height;
 	int num_samples;
+    // optional raytracer features
+    RaytracerSettings settings;
 };
 
 class RaytracerApplication : public Application
@@ -281,6 +283,7 @@ void RaytracerApplication::toggle_raytracing( int width, int height )
 
         // initialize the raytracer (first make sure camera aspect is correct)
         scene.camera.aspect = real_t( width ) / real_t( height );
+        raytracer.settings = options.settings;
 
         if (!raytracer.initialize(&scene, options.num_samples, width, height))
 	{
@@ -428,7 +431,11 @@ static void print_usage( const char* progname )
 {
     std::cout << "Usage: " << progname <<
 	"input_scene [-n num_samples] [-r] [-d width"
-	" height] [-o output_file]\n"
+	" height] [-o output_file] [-c photon_cache] [-i]"
+	" [-a accuracy] [-k irradiance_cache] [-p passes] [-g]"
+	" [-f gather_rays] [-u] [-m max_depth]"
+	" [-q random|stratified|halton|sobol] [-e]"
+	" [-t megabytes]\n"
         "\n" \
         "Options:\n" \
         "\n" \
@@ -443,6 +450,43 @@ static void print_usage( const char* progname )
         "\toutput_file:\n" \
         "\t\tThe output file in which to write the rendered images.\n" \
         "\t\tIf not specified, default timestamped filenames are used.\n" \
+        "\t-c photon_cache\n" \
+        "\t\tSaves the photon maps to this file and reuses them on later\n" \
+        "\t\truns of the same scene, e.g. when only the camera moved.\n" \
+        "\t-i:\n" \
+        "\t\tPrecomputes irradiance at a subset of the global photons, so\n" \
+        "\t\tindirect lighting only needs a single nearest photon lookup.\n" \
+        "\t-a accuracy\n" \
+        "\t\tCaches indirect irradiance and interpolates it between\n" \
+        "\t\tpixels. Larger values reuse records further away.\n" \
+        "\t-k irradiance_cache\n" \
+        "\t\tCaches indirect irradiance and keeps the records in this file\n" \
+        "\t\tfor later frames of the same scene.\n" \
+        "\t-p passes\n" \
+        "\t\tRenders with progressive photon mapping, shooting this many\n" \
+        "\t\tpasses of photons instead of building fixed photon maps.\n" \
+        "\t-g:\n" \
+        "\t\tLooks up the photons of each progressive pass in a hashed\n" \
+        "\t\tgrid instead of a kd-tree.\n" \
+        "\t-f gather_rays\n" \
+        "\t\tComputes indirect light by final gathering with this many\n" \
+        "\t\trays per point, from a 10x smaller global map. Combine with\n" \
+        "\t\t-a or -k to cache the gathers.\n" \
+        "\t-u:\n" \
+        "\t\tUses unstratified final gather ray directions.\n" \
+        "\t-m max_depth\n" \
+        "\t\tThe most bounces any ray or photon path may take. Paths\n" \
+        "\t\tare ended earlier by russian roulette. At least 2, defaults\n" \
+        "\t\tto 10.\n" \
+        "\t-q random|stratified|halton|sobol\n" \
+        "\t\tHow pixel, light and hemisphere samples are generated.\n" \
+        "\t\tDefaults to scrambled sobol.\n" \
+        "\t-e:\n" \
+        "\t\tDenoises the finished image with an edge-avoiding filter\n" \
+        "\t\tguided by the albedo, normal and depth of the first hits.\n" \
+        "\t\tNot available with -p.\n" \
+        "\t-t megabytes\n" \
+        "\t\tMemory for decoded textures and their tiles. Defaults to 256.\n" \
         "\n" \
         "Instructions:\n" \
         "\n" \
@@ -501,9 +545,100 @@ static bool parse_args( Options* opt, int argc, char* argv[] )
 		case 'o':
 			if (i < argc - 1)
 				opt->output_filename = argv[++i];
+			break;
+		case 'c':
+			if (i < argc - 1)
+				opt->settings.photon_cache_filename = argv[++i];
+			break;
+		case 'i':
+			opt->settings.precompute_irradiance = true;
+			break;
+		case 'a':
+			opt->settings.irradiance_cache = true;
+			if (i < argc - 1)
+				opt->settings.irradiance_cache_accuracy = atof(argv[++i]);
+			break;
+		case 'k':
+			opt->settings.irradiance_cache = true;
+			if (i < argc - 1)
+				opt->settings.irradiance_cache_filename = argv[++i];
+			break;
+		case 'p':
+			if (i < argc - 1) {
+				int passes = atoi(argv[++i]);
+				if (passes < 0) {
+					std::cout << "Number of progressive passes cannot be negative\n";
+					return false;
+				}
+				opt->settings.progressive_passes = passes;
+			}
+			break;
+		case 'g':
+			opt->settings.photon_hash_grid = true;
+			break;
+		case 'f':
+			if (i < argc - 1) {
+				int rays = atoi(argv[++i]);
+				if (rays < 0) {
+					std::cout << "Number of final gather rays cannot be negative\n";
+					return false;
+				}
+				opt->settings.final_gather_rays = rays;
+			}
+			break;
+		case 'u':
+			opt->settings.final_gather_stratified = false;
+			break;
+		case 'm':
+			if (i < argc - 1) {
+				// photons are stored from their second hit on
+				int max_depth = atoi(argv[++i]);
+				if (max_depth < 2) {
+					std::cout << "Maximum depth must be at least 2\n";
+					return false;
+				}
+				opt->settings.max_depth = max_depth;
+			}
+			break;
+		case 't':
+			if (i < argc - 1) {
+				int megabytes = atoi(argv[++i]);
+				if (megabytes < 1) {
+					std::cout << "Texture memory must be at least 1 megabyte\n";
+					return false;
+				}
+				TextureCache::global().set_memory_budget(size_t(megabytes) << 20);
+			}
+			break;
+		case 'e':
+			opt->settings.denoise = true;
+			break;
+		case 'q':
+			if (i < argc - 1) {
+				const char* name = argv[++i];
+				if (strcmp(name, "random") == 0)
+					opt->settings.sampler = SAMPLER_RANDOM;
+				else if (strcmp(name, "stratified") == 0)
+					opt->settings.sampler = SAMPLER_STRATIFIED;
+				else if (strcmp(name, "halton") == 0)
+					opt->settings.sampler = SAMPLER_HALTON;
+				else if (strcmp(name, "sobol") == 0)
+					opt->settings.sampler = SAMPLER_SOBOL;
+				else {
+					std::cout << "Unknown sampler " << name << "\n";
+					return false;
+				}
+			}
+			break;
 		}
 	}
 
+	// the denoiser has no variance estimate for the photon passes
+	if (opt->settings.denoise && opt->settings.progressive_passes > 0) {
+		std::cout << "Denoising (-e) is not supported with progressive passes (-p).\n";
+		return false;
+	}
+
     return true;
 }
 
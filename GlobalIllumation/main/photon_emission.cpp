@@ -0,0 +1,177 @@
+/**
+ * @file photon_emission.cpp
+ * @brief Light selection and emission direction sampling for photons.
+ */
+
+#include "photon_emission.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace _462 {
+
+// Vose's construction of the alias table
+void AliasTable::build(const std::vector<real_t>& weights)
+{
+    size_t n = weights.size();
+    real_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += std::max(weights[i], real_t(0));
+    }
+
+    pdf.resize(n);
+    threshold.resize(n);
+    alias.resize(n);
+    std::vector<size_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+        pdf[i] = sum > 0 ? std::max(weights[i], real_t(0))/sum : real_t(1)/n;
+        threshold[i] = pdf[i]*n;
+        alias[i] = i;
+        if (threshold[i] < 1) {
+            small.push_back(i);
+        } else {
+            large.push_back(i);
+        }
+    }
+
+    // pair each underfull slot with an overfull one
+    while (!small.empty() && !large.empty()) {
+        size_t s = small.back();
+        size_t l = large.back();
+        small.pop_back();
+        alias[s] = l;
+        threshold[l] -= 1 - threshold[s];
+        if (threshold[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // whatever is left is full up to rounding
+    for (size_t i = 0; i < small.size(); i++) {
+        threshold[small[i]] = 1;
+    }
+    for (size_t i = 0; i < large.size(); i++) {
+        threshold[large[i]] = 1;
+    }
+}
+
+size_t AliasTable::sample(real_t u) const
+{
+    real_t x = u*pdf.size();
+    size_t i = std::min(size_t(x), pdf.size() - 1);
+    return x - i < threshold[i] ? i : alias[i];
+}
+
+static inline Vector3 cell_direction(real_t z, real_t phi)
+{
+    real_t r = sqrt(std::max(real_t(0), 1 - z*z));
+    return Vector3(r*cos(phi), r*sin(phi), z);
+}
+
+struct BoundingSphere {
+    Vector3 center;
+    real_t radius;
+};
+
+static real_t box_distance(const Vector3& p, const Vector3& min, const Vector3& max)
+{
+    Vector3 q(clamp(p.x, min.x, max.x), clamp(p.y, min.y, max.y), clamp(p.z, min.z, max.z));
+    return distance(p, q);
+}
+
+/*
+ * Adds spheres around the box that leave out a light of radius around
+ * origin, halving the box along its longest side as needed. The pieces
+ * are split on until they look at most about 60 degrees wide from the
+ * light, so their spheres bound them tightly. Returns false if the light
+ * is within the box, or still within a sphere after max_splits.
+ */
+static bool bound_box(const Vector3& origin, real_t radius, const Vector3& min, const Vector3& max,
+                      int max_splits, std::vector<BoundingSphere>& spheres)
+{
+    BoundingSphere sphere;
+    sphere.center = (min + max)*0.5;
+    sphere.radius = 0.5*distance(min, max);
+    real_t dist = distance(sphere.center, origin);
+    if (dist > 2*sphere.radius + radius || (max_splits == 0 && dist > sphere.radius + radius)) {
+        spheres.push_back(sphere);
+        return true;
+    }
+    if (max_splits == 0 || box_distance(origin, min, max) <= radius) {
+        return false;
+    }
+
+    Vector3 size = max - min;
+    int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+    Vector3 split_max = max;
+    Vector3 split_min = min;
+    split_max[axis] = split_min[axis] = sphere.center[axis];
+    return bound_box(origin, radius, min, split_max, max_splits - 1, spheres)
+        && bound_box(origin, radius, split_min, max, max_splits - 1, spheres);
+}
+
+void ProjectionMap::build(const Vector3& origin, real_t radius, const std::vector<BoundingBox>& boxes)
+{
+    active_cells.clear();
+
+    std::vector<BoundingSphere> spheres;
+    for (size_t i = 0; i < boxes.size(); i++) {
+        if (!bound_box(origin, radius, boxes[i].min, boxes[i].max, PROJECTION_MAP_MAX_SPLITS, spheres)) {
+            // some geometry surrounds the light, so any direction may reach it
+            for (unsigned int j = 0; j < PROJECTION_MAP_THETA*PROJECTION_MAP_PHI; j++) {
+                active_cells.push_back(j);
+            }
+            return;
+        }
+    }
+
+    real_t dz = real_t(2)/PROJECTION_MAP_THETA;
+    real_t dphi = 2*PI/PROJECTION_MAP_PHI;
+
+    for (unsigned int t = 0; t < PROJECTION_MAP_THETA; t++) {
+        real_t z0 = -1 + t*dz;
+        for (unsigned int p = 0; p < PROJECTION_MAP_PHI; p++) {
+            real_t phi0 = p*dphi;
+            Vector3 center = cell_direction(z0 + 0.5*dz, phi0 + 0.5*dphi);
+
+            // bound the cell by a cone through its corners and edge midpoints
+            real_t cell_cos = 1;
+            for (int k = 0; k < 9; k++) {
+                Vector3 d = cell_direction(z0 + 0.5*(k/3)*dz, phi0 + 0.5*(k%3)*dphi);
+                cell_cos = std::min(cell_cos, dot(center, d));
+            }
+            real_t cell_angle = acos(clamp(cell_cos, real_t(-1), real_t(1)));
+
+            // a ray leaving any point of the light in direction d reaches
+            // a sphere only if the ray from origin in direction d reaches
+            // it grown by the light radius. bound_box keeps origin outside.
+            bool active = false;
+            for (size_t i = 0; i < spheres.size() && !active; i++) {
+                Vector3 v = spheres[i].center - origin;
+                real_t dist = length(v);
+                real_t angle = acos(clamp(dot(center, v)/dist, real_t(-1), real_t(1)));
+                active = angle <= cell_angle + asin((spheres[i].radius + radius)/dist);
+            }
+            if (active) {
+                active_cells.push_back(t*PROJECTION_MAP_PHI + p);
+            }
+        }
+    }
+}
+
+real_t ProjectionMap::coverage() const
+{
+    return real_t(active_cells.size())/(PROJECTION_MAP_THETA*PROJECTION_MAP_PHI);
+}
+
+Vector3 ProjectionMap::sample_direction(real_t u0, real_t u1, real_t u2) const
+{
+    size_t i = std::min(size_t(u0*active_cells.size()), active_cells.size() - 1);
+    unsigned int t = active_cells[i]/PROJECTION_MAP_PHI;
+    unsigned int p = active_cells[i]%PROJECTION_MAP_PHI;
+    real_t z = -1 + (t + u1)*(real_t(2)/PROJECTION_MAP_THETA);
+    real_t phi = (p + u2)*(2*PI/PROJECTION_MAP_PHI);
+    return cell_direction(z, phi);
+}
+
+} /* _462 */
@@ -0,0 +1,74 @@
+/**
+ * @file photon_emission.hpp
+ * @brief Light selection and emission direction sampling for photons.
+ */
+
+#ifndef _462_PHOTON_EMISSION_HPP_
+#define _462_PHOTON_EMISSION_HPP_
+
+#include "math/vector.hpp"
+
+#include <vector>
+
+namespace _462 {
+
+#define PROJECTION_MAP_THETA 64
+#define PROJECTION_MAP_PHI 128
+// halvings of a box around a light before its directions are all taken
+#define PROJECTION_MAP_MAX_SPLITS 16
+
+/*
+ * Walker's alias table: picks index i with probability weight[i]/sum in
+ * constant time from a single uniform number.
+ */
+class AliasTable {
+public:
+
+    // falls back to equal probabilities if no weight is positive
+    void build(const std::vector<real_t>& weights);
+    size_t sample(real_t u) const;
+    real_t probability(size_t i) const { return pdf[i]; }
+    size_t size() const { return pdf.size(); }
+
+private:
+
+    std::vector<real_t> pdf;
+    std::vector<real_t> threshold;
+    std::vector<size_t> alias;
+};
+
+// the bounds of some geometry, to build projection maps from
+struct BoundingBox {
+    Vector3 min;
+    Vector3 max;
+};
+
+/*
+ * Jensen's projection map: the sphere of directions around a light, cut
+ * into equal solid angle cells (uniform in cos theta and phi). A cell is
+ * active if a ray leaving the light through it can reach one of the
+ * bounding boxes, and photons are only emitted through active cells.
+ *
+ * The boxes are tested through bounding spheres. A box whose sphere holds
+ * the light is halved until the spheres of its pieces do not, so walls
+ * and floors around a light still leave cells inactive. If the light is
+ * within a box itself, every direction is active.
+ */
+class ProjectionMap {
+public:
+
+    // the light is a sphere of radius around origin
+    void build(const Vector3& origin, real_t radius, const std::vector<BoundingBox>& boxes);
+    // fraction of the directions that are emitted, the photon power scale
+    real_t coverage() const;
+    // uniform direction within a random active cell
+    Vector3 sample_direction(real_t u0, real_t u1, real_t u2) const;
+
+private:
+
+    std::vector<unsigned int> active_cells;
+};
+
+} /* _462 */
+
+#endif /* _462_PHOTON_EMISSION_HPP_ */
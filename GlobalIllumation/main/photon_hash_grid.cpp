@@ -0,0 +1,121 @@
+/**
+ * @file photon_hash_grid.cpp
+ * @brief Hashed uniform grid for fixed radius photon gathers.
+ */
+
+#include "photon_hash_grid.hpp"
+
+#include <cmath>
+
+namespace _462 {
+
+PhotonHashGrid::PhotonHashGrid()
+    : cell_size(1), inv_cell_size(1), num_buckets(0) { }
+
+// spatial hash of Teschner et al., num_buckets is a power of two
+size_t PhotonHashGrid::bucket(int x, int y, int z) const
+{
+    unsigned int h = ((unsigned int)x*73856093u) ^ ((unsigned int)y*19349663u)
+                   ^ ((unsigned int)z*83492791u);
+    return h & (num_buckets - 1);
+}
+
+void PhotonHashGrid::build(Photon map[], size_t num, real_t max_radius2)
+{
+    photons.resize(num);
+    num_buckets = 0;
+    if (num == 0) {
+        bucket_start.clear();
+        return;
+    }
+
+    cell_size = max_radius2 > 0 ? sqrt(max_radius2) : real_t(1);
+    inv_cell_size = 1/cell_size;
+    num_buckets = 1;
+    while (num_buckets < num) {
+        num_buckets *= 2;
+    }
+
+    // counting sort by bucket: count, prefix sum, then scatter
+    photon_bucket.resize(num);
+    bucket_start.assign(num_buckets + 1, 0);
+
+#pragma omp parallel for
+    for (int i = 0; i < (int)num; i++) {
+        const float* p = map[i].position;
+        size_t b = bucket(int(floor(p[0]*inv_cell_size)),
+                          int(floor(p[1]*inv_cell_size)),
+                          int(floor(p[2]*inv_cell_size)));
+        photon_bucket[i] = (unsigned int)b;
+#pragma omp atomic
+        bucket_start[b + 1]++;
+    }
+
+    for (size_t i = 0; i < num_buckets; i++) {
+        bucket_start[i + 1] += bucket_start[i];
+    }
+
+    std::vector<unsigned int> next(bucket_start.begin(), bucket_start.end() - 1);
+
+#pragma omp parallel for
+    for (int i = 0; i < (int)num; i++) {
+        unsigned int slot;
+#pragma omp atomic capture
+        slot = next[photon_bucket[i]]++;
+        photons[slot] = map[i];
+    }
+}
+
+// Same estimate as KDtree::gather. radius2 must not exceed the one the grid
+// was built for.
+void PhotonHashGrid::gather(Vector3 pt, Vector3 normal, real_t radius2, Color3 &flux, size_t &count)
+{
+    flux = Color3(0.0, 0.0, 0.0);
+    count = 0;
+    if (num_buckets == 0) {
+        return;
+    }
+
+    int cx = int(floor(pt.x*inv_cell_size));
+    int cy = int(floor(pt.y*inv_cell_size));
+    int cz = int(floor(pt.z*inv_cell_size));
+
+    // neighbouring cells can hash to the same bucket, scan each bucket once
+    size_t visited[27];
+    size_t num_visited = 0;
+
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                size_t b = bucket(cx + dx, cy + dy, cz + dz);
+                bool seen = false;
+                for (size_t i = 0; i < num_visited && !seen; i++) {
+                    seen = visited[i] == b;
+                }
+                if (seen) {
+                    continue;
+                }
+                visited[num_visited++] = b;
+
+                // the bucket may also hold photons of other cells, the
+                // distance test sorts them out
+                for (unsigned int i = bucket_start[b]; i < bucket_start[b + 1]; i++) {
+                    const Photon& photon = photons[i];
+                    real_t px = pt.x - photon.position[0];
+                    real_t py = pt.y - photon.position[1];
+                    real_t pz = pt.z - photon.position[2];
+                    if (px*px + py*py + pz*pz >= radius2) {
+                        continue;
+                    }
+                    real_t cos_in = -dot(photon.get_direction(), normal);
+                    if (cos_in > 0) {
+                        flux += photon.get_power()*cos_in;
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+} /* _462 */
@@ -0,0 +1,46 @@
+/**
+ * @file photon_hash_grid.hpp
+ * @brief Hashed uniform grid for fixed radius photon gathers.
+ */
+
+#ifndef _462_PHOTON_HASH_GRID_HPP_
+#define _462_PHOTON_HASH_GRID_HPP_
+
+#include "KDtree.hpp"
+
+#include <vector>
+
+namespace _462 {
+
+/*
+ * Uniform grid with the cell size set to the largest gather radius, so a
+ * gather only has to scan the 27 cells around the query point. Cells are
+ * hashed into a table with about one bucket per photon, and the photons
+ * are copied bucket by bucket with a counting sort, so a bucket is a
+ * contiguous range. Unlike the KDtree it takes O(n) to build and every
+ * step of the build runs in parallel.
+ */
+class PhotonHashGrid : public PhotonMap {
+public:
+
+    PhotonHashGrid();
+
+    void build(Photon map[], size_t num, real_t max_radius2);
+    void gather(Vector3 pt, Vector3 normal, real_t radius2, Color3 &flux, size_t &count);
+
+private:
+
+    size_t bucket(int x, int y, int z) const;
+
+    real_t cell_size;
+    real_t inv_cell_size;
+    size_t num_buckets;
+    // photons of bucket i are photons[bucket_start[i] .. bucket_start[i+1])
+    std::vector<Photon> photons;
+    std::vector<unsigned int> bucket_start;
+    std::vector<unsigned int> photon_bucket;
+};
+
+} /* _462 */
+
+#endif /* _462_PHOTON_HASH_GRID_HPP_ */
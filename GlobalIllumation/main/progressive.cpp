@@ -0,0 +1,224 @@
+/**
+ * @file progressive.cpp
+ * @brief Progressive photon mapping mode of the Raytracer.
+ *
+ * Hachisuka et al.'s progressive photon mapping: the diffuse points seen
+ * from the camera are found once, then photons are shot in passes of
+ * PPM_PHOTONS_PER_PASS. After each pass every hit point shrinks its radius
+ * and rescales its flux, and the pass photons are discarded, so memory
+ * stays constant while the estimate keeps converging.
+ */
+
+#include "raytracer.hpp"
+
+#include <SDL_timer.h>
+#include <iostream>
+
+namespace _462 {
+
+void Raytracer::initialize_progressive()
+{
+    release_photon_maps();
+    delete [] direct_buffer;
+    delete [] pass_map;
+    pass_map = NULL;
+    hit_points.clear();
+    prepare_emission();
+
+    direct_buffer = new Color3[width*height];
+    pass_lookup = settings.photon_hash_grid ? (PhotonMap*)&pass_grid : (PhotonMap*)&pass_tree;
+    progressive_pass = 0;
+    progressive_emitted = 0;
+
+    real_t dx = real_t(1)/width;
+    real_t dy = real_t(1)/height;
+    real_t sample_weight = real_t(1)/num_samples;
+    SamplerType sampler_type = settings.sampler;
+    std::vector< std::vector<HitPoint> > row_points(height);
+
+    // the eye pass: direct light by ray tracing, plus the hit points
+#pragma omp parallel for
+    for (int y = 0; y < (int)height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            size_t pixel = y*width + x;
+            Color3 direct = Color3::Black();
+            Sampler sampler(sampler_type, num_samples);
+
+            for (unsigned int iter = 0; iter < num_samples; iter++) {
+                real_t u, v;
+                sampler.start_sample(pixel, iter);
+                sampler.get_2d(u, v);
+                real_t i = real_t(2)*(real_t(x)+u)*dx - real_t(1);
+                real_t j = real_t(2)*(real_t(y)+v)*dy - real_t(1);
+                Ray r = Ray(scene->camera.get_position(), Ray::get_pixel_dir(i, j));
+                r.set_pixel_differentials(i, j, 2*dx, 2*dy);
+
+                SurfaceHit hit;
+                find_hit(r, hit);
+                Color3 sample = 0.6*recursive_raytracing(r, 0, 1, &hit, &sampler);
+                direct += sample;
+                trace_hit_points(r, 0, Color3(sample_weight, sample_weight, sample_weight),
+                                 pixel, row_points[y], &hit);
+            }
+            direct_buffer[pixel] = direct*sample_weight;
+        }
+    }
+
+    for (size_t y = 0; y < height; y++) {
+        hit_points.insert(hit_points.end(), row_points[y].begin(), row_points[y].end());
+    }
+
+    // start with a radius relative to the size of the visible scene
+    if (!hit_points.empty()) {
+        Vector3 min = hit_points[0].position;
+        Vector3 max = min;
+        for (size_t i = 1; i < hit_points.size(); i++) {
+            min = vmin(min, hit_points[i].position);
+            max = vmax(max, hit_points[i].position);
+        }
+        real_t radius = PPM_INITIAL_RADIUS*distance(min, max);
+        for (size_t i = 0; i < hit_points.size(); i++) {
+            hit_points[i].radius2 = radius*radius;
+        }
+    }
+
+    std::cout << "Traced " << hit_points.size() << " hit points.\n";
+}
+
+// follows r through specular bounces like map_color, storing the diffuse hits
+void Raytracer::trace_hit_points(const Ray& r, size_t reflectTime, Color3 weight, size_t pixel,
+                                 std::vector<HitPoint>& points, const SurfaceHit* hit)
+{
+    if (reflectTime >= settings.max_depth) {
+        return;
+    }
+    reflectTime++;
+
+    SurfaceHit local_hit;
+    if (!hit) {
+        find_hit(r, local_hit, MATERIAL_COLORS|MATERIAL_NORMAL);
+        hit = &local_hit;
+    }
+    if (hit->geometry_index < 0) {
+        return;
+    }
+
+    Vector3 inter_Pt = hit->position;
+    const Material_Para& material_para = hit->material;
+
+    if (material_para.diffuse != Color3::Black() && material_para.refractive_index == 0) {
+
+        HitPoint hp;
+        hp.position = inter_Pt;
+        hp.normal = dot(r.d, material_para.normal) > 0 ? -material_para.normal : material_para.normal;
+        hp.weight = weight*material_para.diffuse;
+        hp.pixel = pixel;
+        hp.radius2 = 0;
+        hp.num_photons = 0;
+        hp.flux = Color3::Black();
+        points.push_back(hp);
+
+    }else if (material_para.specular != Color3::Black() && material_para.refractive_index == 0) {
+
+        Vector3 newray_direction = normalize(r.d - 2*dot(material_para.normal, r.d)*material_para.normal);
+        trace_hit_points(Ray(inter_Pt, newray_direction), reflectTime, weight, pixel, points);
+
+    }else if (material_para.refractive_index != 0) {
+
+        real_t R;
+        Vector3 refract_direction;
+        if (caculate_Refracted_Ray(R, material_para, r, refract_direction)) {
+            trace_hit_points(Ray(inter_Pt, refract_direction), reflectTime, weight*(1-R), pixel, points);
+        } else {
+            R = 1;
+        }
+        Vector3 newray_direction = normalize(r.d - 2*dot(material_para.normal, r.d)*material_para.normal);
+        trace_hit_points(Ray(inter_Pt, newray_direction), reflectTime, weight*R, pixel, points);
+    }
+}
+
+// shoots one pass of photons and folds them into the hit point statistics
+void Raytracer::photon_pass()
+{
+    if (!pass_map) {
+        pass_map = new Photon[PPM_MAX_STORED];
+    }
+    num_pass_photons = 0;
+
+    for (size_t i = 0; i < PPM_PHOTONS_PER_PASS; i++) {
+        photon_trace(emit_photon(), 0, false);
+    }
+    progressive_emitted += PPM_PHOTONS_PER_PASS;
+
+    // the radii only shrink, so the grid cells can shrink with them
+    real_t max_radius2 = 0;
+    for (size_t i = 0; i < hit_points.size(); i++) {
+        max_radius2 = std::max(max_radius2, hit_points[i].radius2);
+    }
+
+    pass_lookup->build(pass_map, num_pass_photons, max_radius2);
+
+#pragma omp parallel for
+    for (int i = 0; i < (int)hit_points.size(); i++) {
+        HitPoint& hp = hit_points[i];
+        Color3 flux;
+        size_t count;
+        pass_lookup->gather(hp.position, hp.normal, hp.radius2, flux, count);
+        if (count == 0) {
+            continue;
+        }
+
+        // keep a fraction alpha of the new photons and shrink the radius to match
+        real_t num_photons = hp.num_photons + PPM_ALPHA*count;
+        real_t ratio = num_photons/(hp.num_photons + count);
+        hp.radius2 *= ratio;
+        hp.flux = (hp.flux + flux)*ratio;
+        hp.num_photons = num_photons;
+    }
+
+    progressive_pass++;
+}
+
+/*
+ * Runs photon passes until max_time is used up and writes the current
+ * estimate into buffer after each of them. Done after
+ * settings.progressive_passes passes.
+ */
+bool Raytracer::progressive_raytrace(unsigned char* buffer, real_t* max_time)
+{
+    unsigned int end_time = 0;
+    if (max_time) {
+        end_time = SDL_GetTicks() + (unsigned int)(*max_time * 1000);
+    }
+
+    while (progressive_pass < settings.progressive_passes
+           && (!max_time || end_time > SDL_GetTicks())) {
+
+        photon_pass();
+        printf("Photon pass %d, %d photons stored\n", (int)progressive_pass, (int)num_pass_photons);
+
+        std::vector<Color3> image(direct_buffer, direct_buffer + width*height);
+        real_t scale = PPM_SCALE/(PI*progressive_emitted);
+        for (size_t i = 0; i < hit_points.size(); i++) {
+            const HitPoint& hp = hit_points[i];
+            if (hp.radius2 > 0) {
+                image[hp.pixel] += hp.weight*hp.flux*(scale/hp.radius2);
+            }
+        }
+
+#pragma omp parallel for
+        for (int i = 0; i < (int)(width*height); i++) {
+            image[i].to_array(&buffer[4*i]);
+        }
+    }
+
+    bool is_done = progressive_pass >= settings.progressive_passes;
+    if (is_done) {
+        delete [] pass_map;
+        pass_map = NULL;
+        printf("Done raytracing!\n");
+    }
+    return is_done;
+}
+
+} /* _462 */
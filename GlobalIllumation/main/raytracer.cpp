@@ -15,6 +15,15 @@
 #include <SDL_timer.h>
 #include <iostream>
 #include <random>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #ifdef OPENMP // just a defense in case OpenMP is not installed.
 
@@ -31,16 +40,79 @@ namespace _462 {
 
 static const unsigned STEP_SIZE = 8;
 
+RaytracerSettings::RaytracerSettings()
+    : photon_cache_filename(NULL), precompute_irradiance(false),
+      irradiance_cache(false), irradiance_cache_accuracy(IRRADIANCE_CACHE_ACCURACY),
+      irradiance_cache_filename(NULL), progressive_passes(0), max_depth(MAX_DEPTH), sampler(SAMPLER_SOBOL),
+      final_gather_rays(0), final_gather_stratified(true), photon_hash_grid(false),
+      denoise(false) { }
+
 Raytracer::Raytracer()
-    : scene(0), width(0), height(0) { }
+    : scene(0), width(0), height(0), color_buffer(NULL), global_map(NULL), caustic_map(NULL),
+      num_photons_global(0), num_photons_caustic(0), caustic_shoot_num(0),
+      caustic_coe(0), caustic_pass(false), has_caustics(false),
+      photon_directions(sample_uniform_sphere_n), bounce_directions(sample_cosine_hemisphere_n),
+      photon_scene_hash(0),
+      photon_maps_ready(false), photon_file_data(NULL), photon_file_size(0),
+      irradiance_map(NULL), irradiance_radius2(0), irradiance_cache_ready(false),
+      direct_buffer(NULL), pass_map(NULL), num_pass_photons(0),
+      pass_lookup(&pass_tree) { }
+
+// largest channel, the throughput of a path scaled by c
+static inline real_t max_component(const Color3& c)
+{
+    return std::max(c.r, std::max(c.g, c.b));
+}
+
+/*
+ * Russian roulette: the probability to continue a path that would carry
+ * the given throughput. Paths are only cut after RUSSIAN_ROULETTE_DEPTH
+ * bounces, except those carrying nothing, and the survivors are scaled by
+ * 1/probability so the estimate stays unbiased.
+ */
+static inline real_t survival_probability(size_t depth, real_t throughput)
+{
+    if (throughput <= 0) {
+        return 0;
+    }
+    if (depth < RUSSIAN_ROULETTE_DEPTH) {
+        return 1;
+    }
+    return std::min(real_t(1), throughput);
+}
 
-// random real_t in [0, 1)
-static inline real_t random()
+// the next two sample dimensions, or random ones without a sampler
+static inline void sample_2d(Sampler* sampler, real_t &u, real_t &v)
 {
-    return real_t(rand())/RAND_MAX;
+    if (sampler) {
+        sampler->get_2d(u, v);
+    } else {
+        u = random_uniform();
+        v = random_uniform();
+    }
 }
 
-Raytracer::~Raytracer() { }
+/*
+ * The strata of the final gather directions: num_u by num_v cells of the
+ * unit square, or a single row of them if not stratified.
+ */
+static void final_gather_grid(const RaytracerSettings& settings, size_t &num_u, size_t &num_v)
+{
+    size_t num_rays = settings.final_gather_rays;
+    num_u = 1;
+    num_v = num_rays;
+    if (settings.final_gather_stratified) {
+        num_u = std::max(size_t(1), (size_t)sqrt(real_t(num_rays)));
+        num_v = (num_rays + num_u - 1)/num_u;
+    }
+}
+
+Raytracer::~Raytracer()
+{
+    release_photon_maps();
+    delete [] direct_buffer;
+    delete [] color_buffer;
+}
 
 /**
  * Initializes the raytracer for the given scene. Overrides any previous
@@ -78,92 +150,405 @@ bool Raytracer::initialize(Scene* scene, size_t num_samples,
     geometries = scene->get_geometries();
     this->lights = scene->get_lights();
     t_max = scene->camera.get_far_clip();
+    geometry_bvh.build(geometries, scene->num_geometries());
+    light_tree.build(lights, scene->num_lights());
+
+    // the denoiser only knows the variance of ray traced samples, not the
+    // photon density noise of progressive passes
+    delete [] color_buffer;
+    color_buffer = NULL;
+    if (settings.denoise && settings.progressive_passes == 0) {
+        color_buffer = new Color3[width*height];
+        denoiser.resize(width, height);
+    }
+
+    // every stratum of the final gather grid needs a ray, or the
+    // directions of the missing ones are under-weighted
+    if (settings.final_gather_rays > 0) {
+        size_t num_u, num_v;
+        final_gather_grid(settings, num_u, num_v);
+        if (num_u*num_v != settings.final_gather_rays) {
+            settings.final_gather_rays = num_u*num_v;
+            std::cout << "Final gathering with " << settings.final_gather_rays
+                      << " rays, a full " << num_u << "x" << num_v << " grid.\n";
+        }
+    }
+
+    // progressive mode keeps no photon maps, only the visible hit points
+    if (settings.progressive_passes > 0) {
+        initialize_progressive();
+        return true;
+    }
 
     // new for photons mapping.	
-    global_map = new Photon[NUM_GLOBAL_MAP];
+    // the maps only depend on lights and geometry, so they survive camera
+    // and resolution changes and can be reloaded from the cache file.
+    unsigned long long hash = photon_map_hash();
+    if (!photon_maps_ready || hash != photon_scene_hash) {
+
+        release_photon_maps();
+        const char* cache_file = settings.photon_cache_filename;
+        if (!cache_file || !load_photon_maps(cache_file, hash)) {
+            build_photon_maps();
+            if (cache_file && !save_photon_maps(cache_file, hash)) {
+                std::cout << "Unable to write photon cache " << cache_file << ".\n";
+            }
+        }
+        photon_scene_hash = hash;
+        photon_maps_ready = true;
+    }
+
+    if (settings.precompute_irradiance && irradiance_tree.num_map == 0) {
+        precompute_irradiance();
+    }
+
+    // cached irradiance is view independent, so it is kept as long as the
+    // photon maps are
+    if (settings.irradiance_cache && !irradiance_cache_ready) {
+        reset_irradiance_cache();
+    }
+
+    return true;
+}
+
+void Raytracer::reset_irradiance_cache()
+{
+    // bound the octree by the global photons, i.e. the lit geometry
+    Vector3 min(-1.0, -1.0, -1.0);
+    Vector3 max(1.0, 1.0, 1.0);
+    if (num_photons_global > 0) {
+        min = max = global_map[0].get_position();
+        for (size_t i = 1; i < num_photons_global; i++) {
+            Vector3 p = global_map[i].get_position();
+            min = vmin(min, p);
+            max = vmax(max, p);
+        }
+    }
+    irradiance_cache.reset(min, max, settings.irradiance_cache_accuracy);
+
+    const char* cache_file = settings.irradiance_cache_filename;
+    if (cache_file && irradiance_cache.load(cache_file, photon_scene_hash)) {
+        std::cout << "Loaded " << irradiance_cache.size()
+                  << " irradiance records from '" << cache_file << "'.\n";
+    }
+    irradiance_cache_ready = true;
+}
+
+/*
+ * Christensen's acceleration: evaluates the full global map gather at every
+ * IRRADIANCE_STRIDE-th photon up front, so that rendering only needs the
+ * nearest precomputed photon with a similar normal.
+ */
+void Raytracer::precompute_irradiance()
+{
+    size_t num = num_photons_global / IRRADIANCE_STRIDE;
+    if (num == 0) {
+        return;
+    }
+    irradiance_map = new Photon[num];
+    real_t radius2_sum = 0;
+
+#pragma omp parallel for reduction(+:radius2_sum)
+    for (int i = 0; i < (int)num; i++) {
+        const Photon& p = global_map[i*IRRADIANCE_STRIDE];
+        real_t radius2 = 0;
+        Color3 irradiance = global_map_tree.calculate_irradiance(p.get_position(), p.get_normal(), NUM_N_GLOBAL, &radius2);
+
+        irradiance_map[i] = p;
+        irradiance_map[i].set_power(irradiance);
+        radius2_sum += radius2;
+    }
+
+    // lookups farther away than a typical gather radius fall back to a full gather
+    irradiance_radius2 = radius2_sum / num;
+    irradiance_tree.num_map = num;
+    irradiance_tree.insert_list(irradiance_map);
+}
+
+// final gathering smooths the global map, so a much smaller one will do
+size_t Raytracer::global_map_size() const
+{
+    return settings.final_gather_rays > 0 ? FINAL_GATHER_GLOBAL_MAP : NUM_GLOBAL_MAP;
+}
+
+// everything the photon maps depend on: the scene contents, map sizes and
+// path depth, and whether the global map holds direct photons for final
+// gathering
+unsigned long long Raytracer::photon_map_hash() const
+{
+    unsigned long long seed = scene->hash();
+    size_t sizes[4] = { global_map_size(), NUM_CAUSTIC_MAP, settings.final_gather_rays > 0,
+                        settings.max_depth };
+    return hash_bytes(sizes, sizeof sizes, seed);
+}
+
+void Raytracer::build_photon_maps()
+{
+    prepare_emission();
+    size_t max_global = global_map_size();
+    global_map = new Photon[max_global];
     caustic_map = new Photon[NUM_CAUSTIC_MAP];
 
-    int numoflights = scene->num_lights();
-    global_map_tree.num_map = NUM_GLOBAL_MAP;
-    global_map_tree.num_full = NUM_N_GLOBAL;
-    caustic_map_tree.num_map = NUM_CAUSTIC_MAP;
-    caustic_map_tree.num_full = NUM_N_CAUSTIC;
     num_photons_global = 0;
     num_photons_caustic = 0;
-    int i = 0;
+    size_t i = 0;
 
 
-    // global mapping
-    while ((num_photons_global < NUM_GLOBAL_MAP) || (num_photons_caustic < NUM_CAUSTIC_MAP)) {    
+    // global mapping. Give up if the photons hardly ever reach a diffuse
+    // surface after their first hit.
+    caustic_pass = false;
+    size_t max_emitted = MAX_EMITTED_PER_STORED*max_global;
+    while (num_photons_global < max_global && i < max_emitted) {
             
-        // create random photons ray
-        int i_index = i % numoflights;  // get different lights
-        
-        Vector3 lights_position;
-        Vector3 d;
-        Ray r;
-        Color3 intensity = lights[i_index].color;
-
-
-        if (lights[i_index].radius!=0) {
-            lights_position = create_montecarol(lights[i_index].position, lights[i_index].radius);
-            d = normalize(lights_position - lights[i_index].position);
-            r.e = lights_position;
-            r.d = d;
-        }else {
-            lights_position = lights[i_index].position;
-            r.e = lights_position;
-            r.d = create_montecarol_vector();
-            
-        }
-        Photon_light p_r(r, intensity, i_index);
-
         // emit photon ray 
-        photon_trace(p_r, 0, false);
+        photon_trace(emit_photon(), 0, false);
         i++;
     }
+    if (num_photons_global < max_global) {
+        std::cout << "Stored only " << num_photons_global << " global photons from "
+                  << i << " emitted.\n";
+    }
 
     shoot_num = (real_t)i;
     modified_coe = 1.0f/shoot_num;
+
+    // caustic mapping, aimed at the specular objects only. Give up if they
+    // are hidden behind diffuse ones.
+    caustic_pass = true;
+    size_t caustic_emitted = 0;
+    while (has_caustics && num_photons_caustic < NUM_CAUSTIC_MAP
+           && caustic_emitted < CAUSTIC_MAX_EMITTED) {
+        photon_trace(emit_photon(true), 0, false);
+        caustic_emitted++;
+    }
+    caustic_pass = false;
+
+    caustic_shoot_num = (real_t)caustic_emitted;
+    caustic_coe = caustic_emitted > 0 ? 1.0f/caustic_shoot_num : 0;
+    global_map_tree.num_map = num_photons_global;
+    global_map_tree.num_full = NUM_N_GLOBAL;
+    caustic_map_tree.num_map = num_photons_caustic;
+    caustic_map_tree.num_full = NUM_N_CAUSTIC;
     global_map_tree.insert_list(global_map);
     caustic_map_tree.insert_list(caustic_map);
+}
+
+/*
+ * Builds the light selection tables and projection maps per light from
+ * the bounding boxes of the geometries, once for all geometry and once
+ * for the specular geometry only. A light is picked with probability
+ * proportional to its power times the fraction of directions in which it
+ * can reach the geometry.
+ */
+void Raytracer::prepare_emission()
+{
+    std::vector<BoundingBox> boxes;
+    std::vector<BoundingBox> specular_boxes;
+    for (size_t i = 0; i < scene->num_geometries(); i++) {
+        BoundingBox box;
+        geometries[i]->get_bounds(&box.min, &box.max);
+        boxes.push_back(box);
+        if (geometries[i]->has_specular()) {
+            specular_boxes.push_back(box);
+        }
+    }
+
+    size_t num_lights = scene->num_lights();
+    std::vector<real_t> weights(num_lights);
+    std::vector<real_t> caustic_weights(num_lights);
+    projection_maps.resize(num_lights);
+    caustic_projection_maps.resize(num_lights);
+    has_caustics = false;
+    for (size_t i = 0; i < num_lights; i++) {
+        projection_maps[i].build(lights[i].position, lights[i].radius, boxes);
+        caustic_projection_maps[i].build(lights[i].position, lights[i].radius, specular_boxes);
+        const Color3& c = lights[i].color;
+        weights[i] = (c.r + c.g + c.b)*projection_maps[i].coverage();
+        caustic_weights[i] = (c.r + c.g + c.b)*caustic_projection_maps[i].coverage();
+        has_caustics = has_caustics || caustic_weights[i] > 0;
+    }
+    light_table.build(weights);
+    caustic_light_table.build(caustic_weights);
+}
+
+/*
+ * Creates a photon leaving a light picked by power. The power is divided by the
+ * selection probability and scaled by the projection map coverage, so the
+ * estimate is the same as shooting every light equally in all directions.
+ */
+Photon_light Raytracer::emit_photon(bool caustic)
+{
+    const AliasTable& table = caustic ? caustic_light_table : light_table;
+    size_t i_index = table.sample(random_uniform());
+    const SphereLight& light = lights[i_index];
+    const ProjectionMap& projection = caustic ? caustic_projection_maps[i_index]
+                                              : projection_maps[i_index];
+
+    real_t coverage = projection.coverage();
+    Vector3 d;
+    if (coverage > 0) {
+        d = projection.sample_direction(random_uniform(), random_uniform(), random_uniform());
+    } else {
+        d = photon_directions.get(photon_random);
+        coverage = 1;
+    }
+
+    // a sphere light emits outward from its surface
+    Ray r(light.position + light.radius*d, d);
+    real_t scale = coverage/(scene->num_lights()*table.probability(i_index));
+    return Photon_light(r, light.color*scale, (int)i_index);
+}
+
+void Raytracer::release_photon_maps()
+{
+    if (photon_file_data) {
+#ifdef _WIN32
+        delete [] (char*)photon_file_data;
+#else
+        munmap(photon_file_data, photon_file_size);
+#endif
+        photon_file_data = NULL;
+        photon_file_size = 0;
+    } else {
+        delete [] global_map;
+        delete [] caustic_map;
+    }
+    global_map = NULL;
+    caustic_map = NULL;
+    photon_maps_ready = false;
+
+    delete [] irradiance_map;
+    irradiance_map = NULL;
+    irradiance_tree.num_map = 0;
+    irradiance_cache_ready = false;
+}
+
+/*
+ * Photon cache file layout: a PhotonCacheHeader followed by the global and
+ * the caustic photons, both already in kd-tree order.
+ */
+struct PhotonCacheHeader {
+    char magic[8];
+    unsigned long long scene_hash;
+    unsigned long long num_global;
+    unsigned long long num_caustic;
+    double shoot_num;
+    double caustic_shoot_num;
+};
+
+static const char PHOTON_CACHE_MAGIC[8] = { 'P', 'H', 'O', 'T', 'M', 'A', 'P', '6' };
+
+bool Raytracer::save_photon_maps(const char* filename, unsigned long long hash)
+{
+    PhotonCacheHeader header;
+    memcpy(header.magic, PHOTON_CACHE_MAGIC, sizeof header.magic);
+    header.scene_hash = hash;
+    header.num_global = num_photons_global;
+    header.num_caustic = num_photons_caustic;
+    header.shoot_num = shoot_num;
+    header.caustic_shoot_num = caustic_shoot_num;
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof header, 1, file) == 1
+           && fwrite(global_map, sizeof(Photon), num_photons_global, file) == num_photons_global
+           && fwrite(caustic_map, sizeof(Photon), num_photons_caustic, file) == num_photons_caustic;
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+        std::cout << "Saved photon maps to '" << filename << "'.\n";
+    }
+    return ok;
+}
+
+// maps the cache file in place; fails if it belongs to a different scene
+bool Raytracer::load_photon_maps(const char* filename, unsigned long long hash)
+{
+    void* data;
+    size_t size;
+
+#ifdef _WIN32
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = new char[size];
+    if (fread(data, 1, size, file) != size) {
+        delete [] (char*)data;
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PhotonCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+    // private mapping, so in-place changes to the photons never reach the file
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+#endif
+
+    photon_file_data = data;
+    photon_file_size = size;
+
+    const PhotonCacheHeader* header = (const PhotonCacheHeader*)data;
+    if (size < sizeof *header
+        || memcmp(header->magic, PHOTON_CACHE_MAGIC, sizeof header->magic) != 0
+        || header->scene_hash != hash
+        || size != sizeof *header + (header->num_global + header->num_caustic)*sizeof(Photon)) {
+        release_photon_maps();
+        return false;
+    }
+
+    num_photons_global = header->num_global;
+    num_photons_caustic = header->num_caustic;
+    global_map = (Photon*)((char*)data + sizeof *header);
+    caustic_map = global_map + num_photons_global;
+    shoot_num = header->shoot_num;
+    modified_coe = 1.0f/shoot_num;
+    caustic_shoot_num = header->caustic_shoot_num;
+    caustic_coe = caustic_shoot_num > 0 ? 1.0f/caustic_shoot_num : 0;
 
+    global_map_tree.num_map = num_photons_global;
+    global_map_tree.num_full = NUM_N_GLOBAL;
+    caustic_map_tree.num_map = num_photons_caustic;
+    caustic_map_tree.num_full = NUM_N_CAUSTIC;
+    global_map_tree.set_list(global_map);
+    caustic_map_tree.set_list(caustic_map);
 
+    std::cout << "Loaded photon maps from '" << filename << "'.\n";
     return true;
 }
 
-bool Raytracer::photon_trace(Photon_light p_r, size_t recursion_time, bool caustic_flag) {
+bool Raytracer::photon_trace(const Photon_light& p_r, size_t recursion_time, bool caustic_flag) {
     
     
-    size_t const recursion_limit = 5;
-
-    if (recursion_time > recursion_limit) {
+    if (recursion_time >= settings.max_depth) {
         return true;
     }
     recursion_time++;
 
-    // loop search for the smallest t and its index. 
+    // search for the smallest t and its index. 
     Ray r = p_r.r;
-    bool hit_flag = false;
-    Solution_info s;
     Solution_info s_min;
-    s_min.t = t_max;
     real_t R; //frensal
 
     int geometry_index = 0;    
-    for (size_t i=0; i<scene->num_geometries(); i++) {
-
-        if (geometries[i]->checkIntersection(r, s, t_max)==true) {
-            hit_flag = true;        
-            if(s.t < s_min.t) {
-                s_min.t = s.t;
-                s_min.beta = s.beta;
-                s_min.gamma = s.gamma;
-                s_min.index = s.index;
-                geometry_index = i;
-            }
-        }
-    }
+    bool hit_flag = intersect(r, s_min, geometry_index);
     
 
     // Caculate the color
@@ -176,24 +561,45 @@ bool Raytracer::photon_trace(Photon_light p_r, size_t recursion_time, bool caust
         // Get the intesect point
         Vector3 inter_Pt = r.e + s_min.t*r.d;
         // Get the geometry property
-        Material_Para material_para = geometries[geometry_index]->getMaterial(r, s_min);
+        // the texture is only looked up for photons that are kept
+        Material_Para material_para = geometries[geometry_index]->getMaterial(r, s_min, MATERIAL_COLORS|MATERIAL_NORMAL);
  
         if (material_para.diffuse != Color3::Black() && material_para.refractive_index == 0 ) {
          
+            // the photon maps are filled in two passes. The caustic pass
+            // keeps the first diffuse hit of the photons that left the light
+            // through specular surfaces, and the global pass every other
+            // diffuse hit, so its caustic photons bounce on unstored.
+            if (!pass_map && caustic_pass && !caustic_flag) {
+                return true;
+            }
+            bool store = pass_map || caustic_flag == caustic_pass;
+
 	    Vector3 d = normalize(p_r.r.d);
+            material_para.texture = geometries[geometry_index]->getMaterial(r, s_min, MATERIAL_TEXTURE).texture;
             diffuse_Color = p_r.intensity*material_para.diffuse;
             direct_Color = diffuse_Color*material_para.texture;   
 
-            // store photon into caustic map list and global map list
-            if (recursion_time>1) { 
+            // store photon into caustic map list and global map list. Final
+            // gathering looks up the global map one bounce later, so there
+            // it has to include the direct photons.
+            if (store && (recursion_time>1 || (settings.final_gather_rays > 0 && !pass_map))) { 
                 Photon p;
-                p.dTimesn = dot(-d, material_para.normal);
-                p.position = inter_Pt;
-                p.intensity = p_r.intensity;
-                p.materialColor = material_para.diffuse;
+                p.set_position(inter_Pt);
+                p.set_power(p_r.intensity);
+                p.set_direction(d);
+                p.set_normal(dot(d, material_para.normal) > 0 ? -material_para.normal : material_para.normal);
 
 
-                if (caustic_flag!=true && num_photons_global<NUM_GLOBAL_MAP) {
+                // a progressive pass keeps all indirect photons in one buffer
+                if (pass_map) {
+                    if (num_pass_photons < PPM_MAX_STORED) {
+                        pass_map[num_pass_photons] = p;
+                        num_pass_photons++;
+                    }
+                }else {
+
+                if (caustic_flag!=true && num_photons_global<global_map_size()) {
                     global_map[num_photons_global] = p; 
                     num_photons_global++;
                 }
@@ -202,14 +608,27 @@ bool Raytracer::photon_trace(Photon_light p_r, size_t recursion_time, bool caust
                     caustic_map[num_photons_caustic] = p;
                     num_photons_caustic++;
                 }
+                }
             }
     
-            // create random_ray
-            Ray random_ray(inter_Pt, create_montecarol_vector());
-            Photon_light p_r_diffuse(random_ray, direct_Color, p_r.index);
+            // the later hits of caustic photons belong to the global map
+            if (!pass_map && caustic_pass) {
+                return true;
+            }
+
+            // bounce with probability the albedo, keeping the power of the
+            // surviving photons. Cosine weighted directions on the side the
+            // photon came from make the Lambertian weight the albedo itself.
+            real_t survival = std::min(real_t(1), max_component(material_para.diffuse*material_para.texture));
+            if (random_uniform() < survival) {
+                Vector3 facing = dot(d, material_para.normal) > 0 ? -material_para.normal : material_para.normal;
+                Ray random_ray(inter_Pt, from_frame(facing, bounce_directions.get(photon_random)));
+                Photon_light p_r_diffuse(random_ray, direct_Color*(1/survival), p_r.index);
              
-            // emit another photon light, random direction
-            photon_trace(p_r_diffuse, recursion_time, caustic_flag);
+                // emit another photon light, random direction. It is no
+                // longer caustic.
+                photon_trace(p_r_diffuse, recursion_time, false);
+            }
     
 
             return true;
@@ -217,33 +636,17 @@ bool Raytracer::photon_trace(Photon_light p_r, size_t recursion_time, bool caust
         // specular object    
         }else if(material_para.specular != Color3::Black() && material_para.refractive_index == 0) {
     
-            real_t random_num = random_uniform();
-            real_t r_tmp = material_para.specular.r;
-            real_t g_tmp = material_para.specular.g;
-            real_t b_tmp = material_para.specular.b;
-            real_t max_RGB;
-            if( r_tmp > g_tmp) {
-                if(r_tmp>b_tmp) {
-                    max_RGB = r_tmp;
-                }else {
-                    max_RGB = b_tmp;
-                }
-            }else {
-                if(g_tmp>b_tmp) {
-                    max_RGB = g_tmp;
-                }else {
-                    max_RGB = b_tmp;
-                }
-            }
-
-            if(random_num < max_RGB) {
+            // reflect with probability the largest specular component, and
+            // divide the surviving power by it as the diffuse bounce does
+            real_t survival = std::min(real_t(1), max_component(material_para.specular));
+            if (random_uniform() < survival) {
     
                 Vector3 newray_direction = r.d - 2*dot(material_para.normal, r.d)*material_para.normal;
                 newray_direction = normalize(newray_direction); 
                 Ray newray(inter_Pt, newray_direction);
 
-                Photon_light p_r_specular(newray, p_r.intensity*material_para.specular, p_r.index);
-                photon_trace(p_r_specular, recursion_time, true);
+                Photon_light p_r_specular(newray, p_r.intensity*material_para.specular*(1/survival), p_r.index);
+                photon_trace(p_r_specular, recursion_time, caustic_flag || recursion_time == 1);
 
             }
 
@@ -278,11 +681,11 @@ bool Raytracer::photon_trace(Photon_light p_r, size_t recursion_time, bool caust
                 // emmit reflected ray
 
                 Photon_light p_r_reflect(newray, p_r.intensity, p_r.index);
-                photon_trace(p_r_reflect, recursion_time, true);
+                photon_trace(p_r_reflect, recursion_time, caustic_flag || recursion_time == 1);
             }else {
                 // emit refracted ray
                Photon_light p_r_refract(refract_ray, p_r.intensity, p_r.index);
-                photon_trace(p_r_refract, recursion_time, true);
+                photon_trace(p_r_refract, recursion_time, caustic_flag || recursion_time == 1);
             }
         }
         return true;
@@ -294,62 +697,70 @@ bool Raytracer::photon_trace(Photon_light p_r, size_t recursion_time, bool caust
 
 }
 
-Vector3 Raytracer::uniformSampleHemiSphere(const Vector3& normal) {
+// finds the closest geometry along r, false if nothing is hit
+bool Raytracer::intersect(const Ray& r, Solution_info &s_min, int &geometry_index)
+{
+    geometry_index = 0;
+    return geometry_bvh.intersect(r, t_max, s_min, geometry_index);
+}
 
-    Vector3 newDir = create_montecarol_vector();
-    if (dot(newDir, normal)<0) {
-        newDir = -newDir;
+// intersect plus the given MaterialFields at the closest hit only
+bool Raytracer::find_hit(const Ray& r, SurfaceHit &hit, unsigned int fields)
+{
+    if (!intersect(r, hit.s, hit.geometry_index)) {
+        hit.geometry_index = -1;
+        return false;
     }
-    return newDir;
+    hit.position = r.e + hit.s.t*r.d;
+    hit.material = geometries[hit.geometry_index]->getMaterial(r, hit.s, fields);
+    return true;
+}
+
+Vector3 Raytracer::uniformSampleHemiSphere(const Vector3& normal) {
 
+    return sample_uniform_hemisphere(normal, random_uniform(), random_uniform());
 }
 
-Color3 Raytracer::map_color(Ray r, size_t reflectTime, bool caustic_flag){
+/*
+ * Follows r through specular surfaces to the first diffuse one and returns
+ * both photon map estimates there: the caustic map in caustic, the global
+ * map in indirect. hit is the first hit of r if it is already known.
+ */
+void Raytracer::map_color(const Ray& r, size_t reflectTime, Color3 &caustic, Color3 &indirect,
+                          real_t throughput, const SurfaceHit* hit){
     
-    size_t const recursion_limit = 5;
-    if (reflectTime > recursion_limit) {
-        return Color3::Black();
+    if (reflectTime >= settings.max_depth) {
+        caustic = indirect = Color3::Black();
+        return;
     }
     reflectTime++;
     
-    bool hit_flag = false;
-    Solution_info s;
-    Solution_info s_min;
-    s_min.t = t_max;
     real_t R; //frensal
 
-    int geometry_index = 0;    
-    for (size_t i=0; i<scene->num_geometries(); i++) {
-
-        if (geometries[i]->checkIntersection(r, s, t_max)==true) {
-            hit_flag = true;        
-            if(s.t < s_min.t) {
-                s_min.t = s.t;
-                s_min.beta = s.beta;
-                s_min.gamma = s.gamma;
-                s_min.index = s.index;
-                geometry_index = i;
-            }
-        }
+    // the photon map estimates need no texture
+    SurfaceHit local_hit;
+    if (!hit) {
+        find_hit(r, local_hit, MATERIAL_COLORS|MATERIAL_NORMAL);
+        hit = &local_hit;
     }
     
-    if (hit_flag == true) {
+    if (hit->geometry_index >= 0) {
 
         //Get the intesect point
-        Vector3 inter_Pt = r.e + s_min.t*r.d;
+        Vector3 inter_Pt = hit->position;
         // Get the geometry property
-        Material_Para material_para = geometries[geometry_index]->getMaterial(r, s_min);
+        const Material_Para& material_para = hit->material;
         
         if (material_para.diffuse != Color3::Black() && material_para.refractive_index == 0 ) {
-            if (caustic_flag) {
-                Color3 tmp_1 = caustic_map_tree.calculate_color(inter_Pt, NUM_N_CAUSTIC)*modified_coe;    
-                
-                return tmp_1;
-            }else {
-                Color3 tmp_2 = global_map_tree.calculate_color(inter_Pt, NUM_N_GLOBAL)*modified_coe;    
-         
-                return tmp_2;    
-            }    
+            // gather on the side of the surface the ray arrives from
+            Vector3 normal = material_para.normal;
+            if (dot(r.d, normal) > 0) {
+                normal = -normal;
+            }
+            caustic = caustic_map_tree.calculate_color(inter_Pt, normal, material_para.diffuse, NUM_N_CAUSTIC)*caustic_coe;    
+            indirect = global_irradiance(inter_Pt, normal)*material_para.diffuse*modified_coe;    
+            return;
+
         }else if (material_para.specular != Color3::Black() && material_para.refractive_index == 0) {
             
             // calculate r 
@@ -357,8 +768,8 @@ Color3 Raytracer::map_color(Ray r, size_t reflectTime, bool caustic_flag){
             newray_direction = normalize(newray_direction); 
             Ray newray(inter_Pt, newray_direction);
 
-            return map_color(newray , reflectTime, caustic_flag);
-
+            map_color(newray , reflectTime, caustic, indirect, throughput);
+            return;
     
         }else if (material_para.refractive_index != 0) {
 
@@ -373,24 +784,121 @@ Color3 Raytracer::map_color(Ray r, size_t reflectTime, bool caustic_flag){
                 R = 1;
             }
             
-            Color3 refract_Color = map_color(refract_ray, reflectTime, caustic_flag);
+            caustic = indirect = Color3::Black();
+            Color3 branch_caustic, branch_indirect;
+
+            real_t q = survival_probability(reflectTime, throughput*(1-R));
+            if (q > 0 && random_uniform() < q) {
+                map_color(refract_ray, reflectTime, branch_caustic, branch_indirect, throughput*(1-R)/q);
+                caustic += branch_caustic*((1-R)/q);
+                indirect += branch_indirect*((1-R)/q);
+            }
             // specular direction
 
             Vector3 newray_direction = r.d - 2*dot(material_para.normal, r.d)*material_para.normal;
             newray_direction = normalize(newray_direction); 
             Ray newray(inter_Pt, newray_direction);
-            Color3 reflect_Color = map_color(newray, reflectTime, caustic_flag);
-            return R*reflect_Color + (1-R)*refract_Color;
+            q = survival_probability(reflectTime, throughput*R);
+            if (q > 0 && random_uniform() < q) {
+                map_color(newray, reflectTime, branch_caustic, branch_indirect, throughput*R/q);
+                caustic += branch_caustic*(R/q);
+                indirect += branch_indirect*(R/q);
+            }
+            return;
 
         }
 
-    }else {
+    }
+    caustic = indirect = scene->background_color;
+}
 
-        return scene->background_color;
+
+/*
+ * Indirect irradiance at a diffuse point seen from the camera: read from
+ * the irradiance cache if possible, else from a final gather or the global
+ * map, and cached for the following pixels.
+ */
+Color3 Raytracer::global_irradiance(Vector3 pt, Vector3 normal)
+{
+    Color3 irradiance;
+    if (settings.irradiance_cache && irradiance_cache.lookup(pt, normal, irradiance)) {
+        return irradiance;
     }
-    return scene->background_color;
+
+    // the distance over which the estimate is smooth
+    real_t radius;
+    if (settings.final_gather_rays > 0) {
+        irradiance = final_gather(pt, normal, radius);
+    } else {
+        real_t radius2 = 0;
+        irradiance = photon_irradiance(pt, normal, radius2);
+        radius = sqrt(radius2);
+    }
+
+    if (settings.irradiance_cache) {
+        irradiance_cache.insert(pt, normal, irradiance, radius);
+    }
+    return irradiance;
 }
 
+// Irradiance estimate of the global map, from the nearest precomputed
+// photon if there is one, else from a full gather.
+Color3 Raytracer::photon_irradiance(Vector3 pt, Vector3 normal, real_t &radius2)
+{
+    const Photon* nearest = NULL;
+
+    // a single neighbour lookup when irradiance was precomputed
+    if (settings.precompute_irradiance && irradiance_tree.num_map > 0) {
+        nearest = irradiance_tree.find_nearest(pt, normal, irradiance_radius2, IRRADIANCE_NORMAL_COS);
+    }
+    if (nearest) {
+        radius2 = irradiance_radius2;
+        return nearest->get_power();
+    }
+    return global_map_tree.calculate_irradiance(pt, normal, NUM_N_GLOBAL, &radius2);
+}
+
+/*
+ * Final gathering: the irradiance at pt is the average of diffuse*E over
+ * settings.final_gather_rays cosine distributed rays, where E is the global
+ * map irradiance where they land. Rays hitting specular surfaces are left
+ * to the caustic map. radius returns the harmonic mean distance of the hits,
+ * Ward's measure of how far the result can be reused.
+ */
+Color3 Raytracer::final_gather(Vector3 pt, Vector3 normal, real_t &radius)
+{
+    // initialize rounded the ray count to fill the grid
+    size_t num_rays = settings.final_gather_rays;
+    size_t num_u, num_v;
+    final_gather_grid(settings, num_u, num_v);
+
+    Color3 sum = Color3::Black();
+    real_t inv_dist_sum = 0;
+    for (size_t k = 0; k < num_rays; k++) {
+        real_t u = (k % num_u + random_uniform())/num_u;
+        real_t v = (k / num_u + random_uniform())/num_v;
+        Vector3 d = sample_cosine_hemisphere(normal, u, v);
+
+        Ray r(pt, d);
+        Solution_info s_min;
+        int geometry_index;
+        if (!intersect(r, s_min, geometry_index)) {
+            continue;
+        }
+        inv_dist_sum += 1/s_min.t;
+
+        Material_Para material_para = geometries[geometry_index]->getMaterial(r, s_min, MATERIAL_COLORS|MATERIAL_NORMAL);
+        if (material_para.diffuse == Color3::Black() || material_para.refractive_index != 0) {
+            continue;
+        }
+        Vector3 hit_normal = dot(d, material_para.normal) > 0 ? -material_para.normal : material_para.normal;
+        real_t radius2;
+        sum += material_para.diffuse*photon_irradiance(r.e + s_min.t*d, hit_normal, radius2);
+    }
+
+    radius = inv_dist_sum > 0 ? num_rays/inv_dist_sum : t_max;
+    return sum*(real_t(1)/num_rays);
+}
 
 /**
  * Performs a raytrace on the given pixel on the current scene.
@@ -416,198 +924,214 @@ Color3 Raytracer::trace_pixel(const Scene* scene,
 
     Color3 res = Color3::Black();
     unsigned int iter;
+    Sampler sampler(settings.sampler, num_samples);
+    PixelFeatures features;
 
     for (iter = 0; iter < num_samples; iter++)
     {
         // pick a point within the pixel boundaries to fire our
         // ray through.
-        real_t i = real_t(2)*(real_t(x)+random())*dx - real_t(1);
-        real_t j = real_t(2)*(real_t(y)+random())*dy - real_t(1);
+        real_t u, v;
+        sampler.start_sample(y*width + x, iter);
+        sampler.get_2d(u, v);
+        real_t i = real_t(2)*(real_t(x)+u)*dx - real_t(1);
+        real_t j = real_t(2)*(real_t(y)+v)*dy - real_t(1);
         Ray r = Ray(scene->camera.get_position(), Ray::get_pixel_dir(i, j));
+        r.set_pixel_differentials(i, j, 2*dx, 2*dy);
+
+        // the three estimators share the primary hit
+        SurfaceHit hit;
+        find_hit(r, hit);
+        Color3 caustic, indirect;
+        map_color(r, 0, caustic, indirect, 1, &hit);
 
         // for directed illumination and specular
-        res += 0.6*recursive_raytracing(r, 0);
+        Color3 sample = 0.6*recursive_raytracing(r, 0, 1, &hit, &sampler);
 	// caustic effect
-        res += 60*map_color(r, 0, true);
+        sample += 60*caustic;
 	// indirect effect
-        res += 150*map_color(r, 0, false);
-
+        sample += 150*indirect;
 
+        res += sample;
+        if (color_buffer) {
+            add_denoise_sample(features, r, hit, sample);
+        }
+    }
+    if (color_buffer) {
+        denoiser.set_pixel(y*width + x, features);
     }
     return res*(real_t(1)/num_samples);
 }
 
-Vector3 Raytracer::create_montecarol(Vector3 pt, real_t radius) {
+void Raytracer::add_denoise_sample(PixelFeatures& features, const Ray& r,
+                                   const SurfaceHit& hit, const Color3& color)
+{
+    if (hit.geometry_index < 0) {
+        features.add_sample(color, Color3(0, 0, 0), Vector3(0, 0, 0), 0);
+        return;
+    }
+    const Material_Para& material = hit.material;
+    features.add_sample(color, material.diffuse*material.texture, material.normal,
+                        distance(r.e, hit.position));
+}
 
-    
-    real_t x = random_gaussian();
-    real_t y = random_gaussian();
-    real_t z = random_gaussian();
-    
-    real_t x_new = x / sqrt(x*x + y*y + z*z);
-    real_t y_new = y / sqrt(x*x + y*y + z*z);
-    real_t z_new = z / sqrt(x*x + y*y + z*z);
-    
-    Vector3 v(x_new, y_new, z_new);
-    v = v*radius + pt;
+// uniform random point on the sphere around pt
+Vector3 Raytracer::create_montecarol(Vector3 pt, real_t radius) {
 
-    return v;
+    return pt + radius*create_montecarol_vector();
 }
 
+// uniform random direction
 Vector3 Raytracer::create_montecarol_vector() {
 
-    
-    real_t x = random_gaussian();
-    real_t y = random_gaussian();
-    real_t z = random_gaussian();
-    
-    real_t x_new = x / sqrt(x*x + y*y + z*z);
-    real_t y_new = y / sqrt(x*x + y*y + z*z);
-    real_t z_new = z / sqrt(x*x + y*y + z*z);
-    
-    Vector3 v(x_new, y_new, z_new);
-
-    return v;
+    return sample_uniform_sphere(random_uniform(), random_uniform());
 }
 
-Color3 Raytracer::calDiffuseColor(Vector3 pt, Material_Para material_para) {
+/*
+ * Direct diffuse lighting at pt. With few lights every light is sampled,
+ * otherwise LIGHT_BVH_SAMPLES lights are picked from the light tree by
+ * their estimated contribution and weighted by 1/probability.
+ */
+Color3 Raytracer::calDiffuseColor(Vector3 pt, Material_Para material_para, Sampler* sampler) {
 
     Color3 diffuse_Color(0.0, 0.0, 0.0);
-    
+
+    if (scene->num_lights() > LIGHT_BVH_MIN_LIGHTS) {
+        for (size_t k=0; k<LIGHT_BVH_SAMPLES; k++) {
+            size_t i;
+            real_t pdf;
+            real_t u = sampler ? sampler->get_1d() : random_uniform();
+            if (light_tree.sample(pt, material_para.normal, u, i, pdf)) {
+                diffuse_Color += light_color(i, pt, material_para, 1, sampler)*(1/(pdf*LIGHT_BVH_SAMPLES));
+            }
+        }
+        return diffuse_Color;
+    }
 
     // for every light
     for(size_t i=0; i<scene->num_lights(); i++) {
+        diffuse_Color = diffuse_Color + light_color(i, pt, material_para, MONTE_CAROL_TIMES, sampler);
+    }
 
-        Color3 diffuse_Color_per(0.0, 0.0, 0.0);
-
-        // create soft shadow(use monte carol)
-    
-        if ( lights[i].radius == 0) {  // which mean it is a point light src.
-            
-                Vector3 lights_position = lights[i].position;
-                Vector3 d = normalize(lights_position - pt);
-                real_t lights_length = distance(lights_position, pt);
-                Ray r(pt, d);
-                bool block = false;   
-            
-                // to check is there any object blocking the light.
-                for(size_t j=0; j<scene->num_geometries(); j++) {
-                    // dummy s
-                    Solution_info s;
-                    if (geometries[j]->checkIntersection(r, s, t_max)==true) {
-               
-                        real_t length_tmp = distance(pt + d*s.t, pt);
-                        if ( length_tmp<lights_length) {
-                            block = true;
-                            continue;  
-                        }      
-                        
-                    }
-                }
-
-                real_t attenuation = 1;
-                real_t insert_angle = 0;
-
-                if (block == false) {
-
-                    attenuation = 1.0/ (lights[i].attenuation.constant + 
-                                        lights[i].attenuation.linear*lights_length + 
-                                        lights[i].attenuation.quadratic*pow(lights_length,2)); 
-                    insert_angle = dot(d, material_para.normal);
-                    if (insert_angle<0) {
-                        insert_angle = 0;
-                    }
-
-                    diffuse_Color_per = lights[i].color*attenuation*material_para.diffuse*insert_angle;
-                }
-            
-        }else {
-
-            int monte_times = 0;
-            // generate random lights position.     
-            for (size_t k=0; k<MONTE_CAROL_TIMES; k++) {
-                
-                // generate random lights position. 
-                Vector3 lights_position = create_montecarol(lights[i].position, lights[i].radius);
-                Vector3 d = normalize(lights_position - pt);
-                real_t lights_length = distance(lights_position, pt);
-                Ray r(pt, d);
-                bool block = false;   
-                // to check is there any object blocking the light.
-                for(size_t j=0; j<scene->num_geometries(); j++) {
-                    // dummy s
-                    Solution_info s;
-                    if (geometries[j]->checkIntersection(r, s, t_max)==true) {
-                        
-                        real_t length_tmp = distance(pt + d*s.t, pt);
-                        if ( length_tmp<lights_length) {
-                            block = true;
-                            continue;  
-                        }      
-                    }
-                }
-
-                real_t attenuation = 1;
-                real_t insert_angle = 0;
+    return diffuse_Color;
+}
 
-                if (block == false) {
+static inline real_t light_attenuation(const SphereLight& light, real_t dist)
+{
+    return 1.0/(light.attenuation.constant +
+                light.attenuation.linear*dist +
+                light.attenuation.quadratic*dist*dist);
+}
 
-                    monte_times++;
+// power heuristic weight of a sample drawn with pdf_a against pdf_b
+static inline real_t mis_weight(real_t pdf_a, real_t pdf_b)
+{
+    return pdf_a*pdf_a/(pdf_a*pdf_a + pdf_b*pdf_b);
+}
 
-                    attenuation = 1.0/ (lights[i].attenuation.constant + 
-                    lights[i].attenuation.linear*lights_length + 
-                    lights[i].attenuation.quadratic*pow(lights_length,2)); 
+/*
+ * Light i at pt. A sphere light of solid angle omega at pt lights it with
+ * color*attenuation*cos/omega per direction of its visible cap, which is
+ * estimated by pairs of one direction sampled uniformly in the cap and one
+ * sampled from the diffuse BRDF, combined with the power heuristic.
+ * LIGHT_MIN_SAMPLES pairs are taken first; more, up to num_rays, only if
+ * their shadow rays disagree, i.e. pt is in the penumbra.
+ */
+Color3 Raytracer::light_color(size_t i, Vector3 pt, const Material_Para& material_para, size_t num_rays,
+                              Sampler* sampler) {
+
+    const SphereLight& light = lights[i];
+    Vector3 to_light = light.position - pt;
+    real_t dist = length(to_light);
+
+    if (light.radius == 0 || dist <= light.radius) {  // a point light, or pt is inside the light
+        Vector3 d = to_light*(1/dist);
+        real_t insert_angle = dot(d, material_para.normal);
+        if (insert_angle <= 0 || shadowed(pt, d, dist)) {
+            return Color3::Black();
+        }
+        return light.color*light_attenuation(light, dist)*material_para.diffuse*insert_angle;
+    }
 
-                    insert_angle = dot(d, material_para.normal);
-                    if (insert_angle<0) {
-                        insert_angle = 0;
-                    }
-                    //caculate the diffuse light
-                    diffuse_Color_per = diffuse_Color_per + lights[i].color*attenuation*material_para.diffuse*insert_angle;
-                }
+    Vector3 axis = to_light*(1/dist);
+    real_t sin_theta_max = light.radius/dist;
+    real_t cos_theta_max = sqrt(1 - sin_theta_max*sin_theta_max);
+    // the whole cap is below the horizon
+    if (dot(axis, material_para.normal) <= -sin_theta_max) {
+        return Color3::Black();
+    }
+    real_t light_pdf = 1/(2*PI*(1 - cos_theta_max));
+
+    Color3 diffuse_Color_per(0.0, 0.0, 0.0);
+    size_t num_pairs = std::min(num_rays, size_t(LIGHT_MIN_SAMPLES));
+    size_t num_visible = 0;
+    size_t num_shadow_rays = 0;
+    size_t k;
+
+    for (k=0; k<num_pairs; k++) {
+        real_t u, v, t;
+
+        // a direction toward the light
+        sample_2d(sampler, u, v);
+        Vector3 d = sample_cone(axis, cos_theta_max, u, v);
+        real_t insert_angle = dot(d, material_para.normal);
+        if (insert_angle > 0) {
+            if (!light.intersect(Ray(pt, d), t)) {
+                // grazing the silhouette
+                t = dist*cos_theta_max;
+            }
+            num_shadow_rays++;
+            if (!shadowed(pt, d, t)) {
+                num_visible++;
+                real_t brdf_pdf = insert_angle/PI;
+                diffuse_Color_per += light.color*light_attenuation(light, t)*material_para.diffuse*
+                                     (insert_angle*mis_weight(light_pdf, brdf_pdf));
             }
-            //sum all the monte carol lights and average all of them.
-            diffuse_Color_per = diffuse_Color_per*(real_t(1.0)/MONTE_CAROL_TIMES);
         }
 
-        diffuse_Color = diffuse_Color + diffuse_Color_per;
+        // a direction from the BRDF, which counts only if it hits the light
+        sample_2d(sampler, u, v);
+        d = sample_cosine_hemisphere(material_para.normal, u, v);
+        insert_angle = dot(d, material_para.normal);
+        if (insert_angle > 0 && light.intersect(Ray(pt, d), t) && !shadowed(pt, d, t)) {
+            real_t brdf_pdf = insert_angle/PI;
+            diffuse_Color_per += light.color*light_attenuation(light, t)*material_para.diffuse*
+                                 (light_pdf*PI*mis_weight(brdf_pdf, light_pdf));
+        }
 
+        // outside the penumbra the first pairs are enough
+        if (k+1 == num_pairs && num_pairs < num_rays &&
+            num_visible != 0 && num_visible != num_shadow_rays) {
+            num_pairs = num_rays;
+        }
     }
 
-    return diffuse_Color;
-
+    return diffuse_Color_per*(real_t(1.0)/num_pairs);
+}
 
+// whether anything lies between pt and dist along the unit direction d
+bool Raytracer::shadowed(const Vector3& pt, const Vector3& d, real_t dist)
+{
+    return geometry_bvh.occluded(Ray(pt, d), std::min(dist, t_max));
 }
 
 
-Color3 Raytracer::recursive_raytracing(Ray r, size_t reflectTime) 
+// throughput is the weight of this path in the pixel, hit the first hit of
+// r if it is already known
+Color3 Raytracer::recursive_raytracing(const Ray& r, size_t reflectTime, real_t throughput, const SurfaceHit* hit,
+                                       Sampler* sampler) 
 {   
-    size_t const recursion_limit = 5;
-    if (reflectTime > recursion_limit) {
+    if (reflectTime >= settings.max_depth) {
         return Color3::Black();
     }
     reflectTime++;
 
-    // loop search for the smallest t and its index. 
-    bool hit_flag = false;
-    Solution_info s;
-    Solution_info s_min;
-    s_min.t = t_max;
     real_t R; //frensal 
 
-    int geometry_index = 0;    
-    for (size_t i=0; i<scene->num_geometries(); i++) {
-
-        if (geometries[i]->checkIntersection(r, s, t_max)==true) {
-            hit_flag = true;        
-            if(s.t < s_min.t) {
-                s_min.t = s.t;
-                s_min.beta = s.beta;
-                s_min.gamma = s.gamma;
-                s_min.index = s.index;
-                geometry_index = i;
-            }
-        }
+    SurfaceHit local_hit;
+    if (!hit) {
+        find_hit(r, local_hit);
+        hit = &local_hit;
     }
 
 
@@ -620,19 +1144,19 @@ Color3 Raytracer::recursive_raytracing(Ray r, size_t reflectTime)
     Color3 refract_Color(0.0, 0.0, 0.0);
     Color3 final_Color(0.0, 0.0, 0.0);
 
-    if (hit_flag == true) {
+    if (hit->geometry_index >= 0) {
 
         //Get the intesect point
-        Vector3 inter_Pt = r.e + s_min.t*r.d;
+        Vector3 inter_Pt = hit->position;
         //Vector3 normal_Pt = ;
         // Get the geometry property
-        Material_Para material_para = geometries[geometry_index]->getMaterial(r, s_min);
+        const Material_Para& material_para = hit->material;
  
         if (material_para.refractive_index == 0 ) {
 
 
             // direct illumination
-            diffuse_Color = calDiffuseColor(inter_Pt, material_para);    
+            diffuse_Color = calDiffuseColor(inter_Pt, material_para, sampler);    
             ambient_Color = material_para.ambient * scene->ambient_light;
             direct_Color = diffuse_Color + ambient_Color;   
 
@@ -647,7 +1171,10 @@ Color3 Raytracer::recursive_raytracing(Ray r, size_t reflectTime)
                 Vector3 newray_direction = r.d - 2*dot(material_para.normal, r.d)*material_para.normal;
                 newray_direction = normalize(newray_direction); 
                 Ray newray(inter_Pt, newray_direction);
-                reflection_Color = recursive_raytracing(newray, reflectTime);
+                newray.reflect_differentials(r, hit->s.t, material_para.normal);
+                reflection_Color = continue_raytracing(newray, reflectTime, throughput,
+                                                       max_component(material_para.specular*material_para.texture),
+                                                       sampler);
                 specular_Color = reflection_Color * material_para.specular;
             }
 
@@ -666,7 +1193,11 @@ Color3 Raytracer::recursive_raytracing(Ray r, size_t reflectTime)
             if ( tir ) {
             
             Ray refract_ray(inter_Pt, refract_direction);
-                refract_Color = recursive_raytracing(refract_ray, reflectTime);
+                real_t eta = dot(r.d, material_para.normal) < 0
+                             ? scene->refractive_index/material_para.refractive_index
+                             : material_para.refractive_index/scene->refractive_index;
+                refract_ray.refract_differentials(r, hit->s.t, material_para.normal, eta);
+                refract_Color = continue_raytracing(refract_ray, reflectTime, throughput, 1-R, sampler);
             } else {
                 R = 1;
             }
@@ -676,7 +1207,8 @@ Color3 Raytracer::recursive_raytracing(Ray r, size_t reflectTime)
             Vector3 newray_direction = r.d - 2*dot(material_para.normal, r.d)*material_para.normal;
             newray_direction = normalize(newray_direction); 
             Ray newray(inter_Pt, newray_direction);
-            reflection_Color = recursive_raytracing(newray, reflectTime);
+            newray.reflect_differentials(r, hit->s.t, material_para.normal);
+            reflection_Color = continue_raytracing(newray, reflectTime, throughput, R, sampler);
             specular_Color = reflection_Color;
 
             // sum all the color part.
@@ -693,7 +1225,19 @@ Color3 Raytracer::recursive_raytracing(Ray r, size_t reflectTime)
     }
 }
 
-bool Raytracer::caculate_Refracted_Ray(real_t &R, Material_Para material_para, Ray r, Vector3 &newray) {
+// Traces a secondary ray whose color will be scaled by weight, subject to
+// russian roulette on the resulting throughput.
+Color3 Raytracer::continue_raytracing(const Ray& r, size_t reflectTime, real_t throughput, real_t weight,
+                                      Sampler* sampler)
+{
+    real_t q = survival_probability(reflectTime, throughput*weight);
+    if (q <= 0 || random_uniform() >= q) {
+        return Color3::Black();
+    }
+    return recursive_raytracing(r, reflectTime, throughput*weight/q, NULL, sampler)*(1/q);
+}
+
+bool Raytracer::caculate_Refracted_Ray(real_t &R, Material_Para material_para, const Ray& r, Vector3 &newray) {
 
     real_t n1;
     real_t n2;
@@ -772,6 +1316,9 @@ bool Raytracer::raytrace(unsigned char* buffer, real_t* max_time)
 {
     // TODO Add any modifications to this algorithm, if needed.
 
+    if (settings.progressive_passes > 0) {
+        return progressive_raytrace(buffer, max_time);
+    }
 
     static const size_t PRINT_INTERVAL = 64;
 
@@ -814,6 +1361,9 @@ bool Raytracer::raytrace(unsigned char* buffer, real_t* max_time)
             {
                 // trace a pixel
                 Color3 color = trace_pixel(scene, x, c_row, width, height);
+                if (color_buffer) {
+                    color_buffer[c_row*width + x] = color;
+                }
                 // write the result to the buffer, always use 1.0 as the alpha
                 color.to_array(&buffer[4 * (c_row * width + x)]);
             }
@@ -822,6 +1372,24 @@ bool Raytracer::raytrace(unsigned char* buffer, real_t* max_time)
 
     if (is_done) printf("Done raytracing!\n");
 
+    if (is_done && color_buffer) {
+        denoiser.denoise(color_buffer);
+#pragma omp parallel for
+        for (int i = 0; i < (int)(width*height); i++) {
+            color_buffer[i].to_array(&buffer[4*i]);
+        }
+    }
+
+    const char* cache_file = settings.irradiance_cache_filename;
+    if (is_done && settings.irradiance_cache && cache_file) {
+        if (irradiance_cache.save(cache_file, photon_scene_hash)) {
+            std::cout << "Saved " << irradiance_cache.size()
+                      << " irradiance records to '" << cache_file << "'.\n";
+        } else {
+            std::cout << "Unable to write irradiance cache " << cache_file << ".\n";
+        }
+    }
+
     return is_done;
 }
 
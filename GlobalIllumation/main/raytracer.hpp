@@ -11,18 +11,43 @@
 #ifndef _462_RAYTRACER_HPP_
 #define _462_RAYTRACER_HPP_
 
-#define MAX_DEPTH 5
+#define MAX_DEPTH 10
+#define RUSSIAN_ROULETTE_DEPTH 2
 #define NUM_GLOBAL_MAP 100000
 #define NUM_CAUSTIC_MAP 10000
 #define NUM_N_GLOBAL 100
 #define NUM_N_CAUSTIC 40
+// photons emitted per map entry before giving up on filling a map
+#define MAX_EMITTED_PER_STORED 100
+#define CAUSTIC_MAX_EMITTED (MAX_EMITTED_PER_STORED*NUM_CAUSTIC_MAP)
+#define FINAL_GATHER_GLOBAL_MAP (NUM_GLOBAL_MAP/10)
+#define LIGHT_BVH_MIN_LIGHTS 8
+#define LIGHT_BVH_SAMPLES 4
+#define LIGHT_MIN_SAMPLES 4
+#define IRRADIANCE_STRIDE 4
+#define IRRADIANCE_NORMAL_COS 0.9
+#define IRRADIANCE_CACHE_ACCURACY 0.5
+#define PPM_PHOTONS_PER_PASS 100000
+#define PPM_MAX_STORED (4*PPM_PHOTONS_PER_PASS)
+#define PPM_ALPHA 0.7
+#define PPM_INITIAL_RADIUS 0.01
+#define PPM_SCALE 150
 
 
 
 #include "math/color.hpp"
 #include "math/random462.hpp"
 #include "scene/scene.hpp"
+#include "scene/bvh.hpp"
 #include "KDtree.hpp"
+#include "photon_hash_grid.hpp"
+#include "photon_emission.hpp"
+#include "light_bvh.hpp"
+#include "sampler.hpp"
+#include "irradiance_cache.hpp"
+#include "denoiser.hpp"
+
+#include <vector>
 
 
 namespace _462 {
@@ -36,13 +61,67 @@ public:
     Ray r;
     int index;
     Color3 intensity;
-    Photon_light(Ray ray, Color3 color, int i) {
+    Photon_light(const Ray& ray, Color3 color, int i) {
         r = ray;
         intensity = color;
         index = i;
     }
 };
 
+/**
+ * Optional rendering features. Filled in from the command line and copied
+ * into the raytracer before initialize() is called.
+ */
+struct RaytracerSettings {
+
+    // file the photon maps are saved to and reloaded from, or NULL
+    const char* photon_cache_filename;
+    // precompute irradiance at a subset of the global photons
+    bool precompute_irradiance;
+    // cache the indirect irradiance across pixels, optionally in a file
+    bool irradiance_cache;
+    real_t irradiance_cache_accuracy;
+    const char* irradiance_cache_filename;
+    // number of progressive photon mapping passes, 0 for the photon maps
+    size_t progressive_passes;
+    // hard cap on the path depth, paths usually end earlier by russian roulette
+    size_t max_depth;
+    // generator of the pixel, light and hemisphere samples
+    SamplerType sampler;
+    // number of final gather rays at the first diffuse hit, 0 to read the
+    // global map directly, and whether their directions are stratified
+    size_t final_gather_rays;
+    bool final_gather_stratified;
+    // gather the pass photons from a PhotonHashGrid instead of a KDtree
+    bool photon_hash_grid;
+    // filter the finished image with the albedo, normal and depth of the
+    // first hits
+    bool denoise;
+
+    RaytracerSettings();
+};
+
+// A visible diffuse point for progressive photon mapping, with the radius
+// and flux statistics that are refined after every photon pass.
+struct HitPoint {
+    Vector3 position;
+    Vector3 normal;         // facing the eye
+    Color3 weight;          // path weight times diffuse color
+    size_t pixel;
+    real_t radius2;
+    real_t num_photons;     // alpha-reduced photon count N
+    Color3 flux;            // accumulated flux tau
+};
+
+// The closest hit of a ray, found once and shared by the estimators that
+// trace the same ray. geometry_index is -1 if nothing was hit.
+struct SurfaceHit {
+    Vector3 position;
+    Solution_info s;
+    int geometry_index;
+    Material_Para material;
+};
+
 class Scene;
 class Ray;
 struct Intersection;
@@ -61,16 +140,33 @@ public:
 
 
     // ray tracing
-    Color3 recursive_raytracing (Ray r, size_t reflectTime); 
-    Color3 calDiffuseColor(Vector3 pt, Material_Para material_para);
+    Color3 recursive_raytracing (const Ray& r, size_t reflectTime, real_t throughput = 1,
+                                 const SurfaceHit* hit = NULL, Sampler* sampler = NULL); 
+    Color3 continue_raytracing(const Ray& r, size_t reflectTime, real_t throughput, real_t weight,
+                               Sampler* sampler);
+    Color3 calDiffuseColor(Vector3 pt, Material_Para material_para, Sampler* sampler = NULL);
+    Color3 light_color(size_t i, Vector3 pt, const Material_Para& material_para, size_t num_rays,
+                       Sampler* sampler);
     Vector3 create_montecarol(Vector3 pt, real_t radius);
     Vector3 create_montecarol_vector();
     Vector3 uniformSampleHemiSphere(const Vector3& normal);
-    bool caculate_Refracted_Ray(real_t &R, Material_Para material_para, Ray r, Vector3 &newray);
+    bool caculate_Refracted_Ray(real_t &R, Material_Para material_para, const Ray& r, Vector3 &newray);
+
+    bool intersect(const Ray& r, Solution_info &s_min, int &geometry_index);
+    bool shadowed(const Vector3& pt, const Vector3& d, real_t dist);
+    bool find_hit(const Ray& r, SurfaceHit &hit, unsigned int fields = MATERIAL_ALL);
 
     // photon mapping
-    bool photon_trace(Photon_light p_r, size_t recursion_time, bool caustic_flag);
-    Color3 map_color(Ray r, size_t reflectTime, bool caustic_flag);
+    // a photon from a light, aimed at the specular geometry if caustic
+    Photon_light emit_photon(bool caustic = false);
+    bool photon_trace(const Photon_light& p_r, size_t recursion_time, bool caustic_flag);
+    void map_color(const Ray& r, size_t reflectTime, Color3 &caustic, Color3 &indirect,
+                   real_t throughput = 1, const SurfaceHit* hit = NULL);
+    Color3 global_irradiance(Vector3 pt, Vector3 normal);
+    Color3 photon_irradiance(Vector3 pt, Vector3 normal, real_t &radius2);
+    Color3 final_gather(Vector3 pt, Vector3 normal, real_t &radius);
+
+    RaytracerSettings settings;
 
 
 
@@ -97,6 +193,18 @@ private:
     Geometry* const* geometries;
     const SphereLight* lights;
     real_t t_max;
+    // closest hit and shadow queries against geometries
+    SceneBVH geometry_bvh;
+    // picks the lights for direct lighting in scenes with many of them
+    LightBVH light_tree;
+
+    // the unquantized image and the first hit features for the denoiser,
+    // if settings.denoise
+    Color3* color_buffer;
+    Denoiser denoiser;
+
+    static void add_denoise_sample(PixelFeatures& features, const Ray& r,
+                                   const SurfaceHit& hit, const Color3& color);
     
 
     // photon mapping
@@ -108,7 +216,71 @@ private:
     KDtree caustic_map_tree;
     real_t shoot_num;
     real_t modified_coe;
-
+    // the caustic map is filled by a separate pass with its own count
+    real_t caustic_shoot_num;
+    real_t caustic_coe;
+    bool caustic_pass;
+
+    // lights are picked by power, and only shoot toward the geometry, or
+    // toward the specular geometry for the caustic pass
+    AliasTable light_table;
+    std::vector<ProjectionMap> projection_maps;
+    AliasTable caustic_light_table;
+    std::vector<ProjectionMap> caustic_projection_maps;
+    bool has_caustics;
+
+    // photons are traced by a single thread, which draws their uniform
+    // emission and cosine bounce directions in batches
+    Pcg32 photon_random;
+    DirectionBatch photon_directions;
+    DirectionBatch bounce_directions;
+
+    void prepare_emission();
+
+    // photon map reuse across camera changes and program runs
+    unsigned long long photon_scene_hash;
+    bool photon_maps_ready;
+    void* photon_file_data;
+    size_t photon_file_size;
+
+    size_t global_map_size() const;
+    unsigned long long photon_map_hash() const;
+    void build_photon_maps();
+    void release_photon_maps();
+    bool save_photon_maps(const char* filename, unsigned long long hash);
+    bool load_photon_maps(const char* filename, unsigned long long hash);
+
+    // precomputed irradiance estimates at every IRRADIANCE_STRIDE-th photon
+    Photon *irradiance_map;
+    KDtree irradiance_tree;
+    real_t irradiance_radius2;
+
+    void precompute_irradiance();
+
+    // lazily filled cache of global_irradiance results
+    IrradianceCache irradiance_cache;
+    bool irradiance_cache_ready;
+
+    void reset_irradiance_cache();
+
+    // progressive photon mapping: hit points are traced once, then each
+    // pass shoots PPM_PHOTONS_PER_PASS photons into pass_map, refines the
+    // hit points and drops the photons again.
+    std::vector<HitPoint> hit_points;
+    Color3* direct_buffer;
+    Photon* pass_map;
+    size_t num_pass_photons;
+    KDtree pass_tree;
+    PhotonHashGrid pass_grid;
+    PhotonMap* pass_lookup;
+    size_t progressive_pass;
+    real_t progressive_emitted;
+
+    void initialize_progressive();
+    void trace_hit_points(const Ray& r, size_t reflectTime, Color3 weight, size_t pixel,
+                          std::vector<HitPoint>& points, const SurfaceHit* hit = NULL);
+    void photon_pass();
+    bool progressive_raytrace(unsigned char* buffer, real_t* max_time);
 
 };
 
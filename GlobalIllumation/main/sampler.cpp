@@ -0,0 +1,184 @@
+/**
+ * @file sampler.cpp
+ * @brief Per pixel sample generation for the ray tracer.
+ */
+
+#include "sampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace _462 {
+
+static const unsigned int NUM_PRIMES = 32;
+static const unsigned int PRIMES[NUM_PRIMES] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+// largest real_t below 1
+static const real_t ONE_MINUS_EPSILON = 1 - std::numeric_limits<real_t>::epsilon()/2;
+
+// integer hash with good avalanche, to derive all random values from
+static inline unsigned int mix(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline unsigned int hash3(unsigned int a, unsigned int b, unsigned int c)
+{
+    return mix(a ^ mix(b ^ mix(c)));
+}
+
+static inline real_t to_unit(unsigned int x)
+{
+    return std::min(real_t(x*(1/4294967296.0)), ONE_MINUS_EPSILON);
+}
+
+// Kensler's hashed permutation: element i of a random permutation of
+// [0, n) chosen by seed, without storing it
+static unsigned int permute(unsigned int i, unsigned int n, unsigned int seed)
+{
+    unsigned int w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+static real_t radical_inverse(unsigned int base, unsigned int i)
+{
+    real_t inv_base = real_t(1)/base;
+    real_t f = inv_base;
+    real_t value = 0;
+    while (i > 0) {
+        value += (i % base)*f;
+        i /= base;
+        f *= inv_base;
+    }
+    return value;
+}
+
+// the first two dimensions of the Sobol sequence, as 32 bit fractions
+static inline unsigned int van_der_corput(unsigned int i)
+{
+    i = (i << 16) | (i >> 16);
+    i = ((i & 0x00ff00ffu) << 8) | ((i & 0xff00ff00u) >> 8);
+    i = ((i & 0x0f0f0f0fu) << 4) | ((i & 0xf0f0f0f0u) >> 4);
+    i = ((i & 0x33333333u) << 2) | ((i & 0xccccccccu) >> 2);
+    i = ((i & 0x55555555u) << 1) | ((i & 0xaaaaaaaau) >> 1);
+    return i;
+}
+
+static inline unsigned int sobol_second(unsigned int i)
+{
+    unsigned int r = 0;
+    for (unsigned int v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+        if (i & 1) {
+            r ^= v;
+        }
+    }
+    return r;
+}
+
+Sampler::Sampler(SamplerType type, size_t samples_per_pixel)
+    : type(type), samples_per_pixel(std::max(samples_per_pixel, size_t(1))),
+      pixel(0), index(0), dimension(0) { }
+
+void Sampler::start_sample(size_t pixel, size_t index)
+{
+    this->pixel = (unsigned int)pixel;
+    this->index = (unsigned int)index;
+    dimension = 0;
+}
+
+real_t Sampler::random(unsigned int dimension) const
+{
+    return to_unit(hash3(pixel, index, dimension));
+}
+
+real_t Sampler::get_1d()
+{
+    unsigned int d = dimension++;
+    unsigned int n = (unsigned int)samples_per_pixel;
+
+    switch (type) {
+    case SAMPLER_STRATIFIED: {
+        unsigned int stratum = permute(index % n, n, hash3(pixel, d, 0x51ed270bu));
+        return std::min((stratum + random(d))/n, ONE_MINUS_EPSILON);
+    }
+    case SAMPLER_HALTON:
+        if (d < NUM_PRIMES) {
+            real_t value = radical_inverse(PRIMES[d], index) + to_unit(hash3(pixel, d, 0x68bc21ebu));
+            return std::min(real_t(value - floor(value)), ONE_MINUS_EPSILON);
+        }
+        return random(d);
+    case SAMPLER_SOBOL: {
+        unsigned int i = permute(index % n, n, hash3(pixel, d, 0x02e5be93u));
+        return to_unit(van_der_corput(i) ^ hash3(pixel, d, 0x967a889bu));
+    }
+    default:
+        return random(d);
+    }
+}
+
+void Sampler::get_2d(real_t &u, real_t &v)
+{
+    unsigned int d = dimension;
+    unsigned int n = (unsigned int)samples_per_pixel;
+
+    switch (type) {
+    case SAMPLER_STRATIFIED: {
+        // a grid of strata at least as large as the sample count
+        unsigned int nx = (unsigned int)ceil(sqrt(real_t(n)));
+        unsigned int ny = (n + nx - 1)/nx;
+        unsigned int stratum = permute(index % n, nx*ny, hash3(pixel, d, 0x51ed270bu));
+        u = std::min((stratum % nx + random(d))/nx, ONE_MINUS_EPSILON);
+        v = std::min((stratum / nx + random(d + 1))/ny, ONE_MINUS_EPSILON);
+        dimension += 2;
+        return;
+    }
+    case SAMPLER_SOBOL: {
+        // one shuffle for the pair keeps the two components together
+        unsigned int i = permute(index % n, n, hash3(pixel, d, 0x02e5be93u));
+        u = to_unit(van_der_corput(i) ^ hash3(pixel, d, 0x967a889bu));
+        v = to_unit(sobol_second(i) ^ hash3(pixel, d + 1, 0x967a889bu));
+        dimension += 2;
+        return;
+    }
+    default:
+        u = get_1d();
+        v = get_1d();
+        return;
+    }
+}
+
+} /* _462 */
@@ -0,0 +1,63 @@
+/**
+ * @file sampler.hpp
+ * @brief Per pixel sample generation for the ray tracer.
+ */
+
+#ifndef _462_SAMPLER_HPP_
+#define _462_SAMPLER_HPP_
+
+#include "math/vector.hpp"
+#include "math/sampling.hpp"
+
+#include <cstddef>
+
+namespace _462 {
+
+enum SamplerType {
+    SAMPLER_RANDOM,
+    SAMPLER_STRATIFIED,
+    SAMPLER_HALTON,
+    SAMPLER_SOBOL
+};
+
+/*
+ * Hands out the sample values of one camera sample, dimension by
+ * dimension: the pixel jitter first, then whatever the estimators ask for
+ * in the order they ask. The same dimension of the samples_per_pixel
+ * samples of a pixel is well distributed for the structured backends:
+ *
+ *  - SAMPLER_STRATIFIED jitters within shuffled strata,
+ *  - SAMPLER_HALTON uses a prime base per dimension, with a random shift
+ *    per pixel,
+ *  - SAMPLER_SOBOL uses the (0,2)-sequence formed by the first two Sobol
+ *    dimensions for every pair of dimensions, with random digit
+ *    scrambling and index shuffling per pixel and pair.
+ *
+ * Values are computed from hashes of (pixel, sample, dimension), so a
+ * Sampler is cheap to create and needs no shared state between threads.
+ */
+class Sampler {
+public:
+
+    Sampler(SamplerType type, size_t samples_per_pixel);
+
+    // starts sample index of pixel at dimension 0
+    void start_sample(size_t pixel, size_t index);
+
+    real_t get_1d();
+    void get_2d(real_t &u, real_t &v);
+
+private:
+
+    real_t random(unsigned int dimension) const;
+
+    SamplerType type;
+    size_t samples_per_pixel;
+    unsigned int pixel;
+    unsigned int index;
+    unsigned int dimension;
+};
+
+} /* _462 */
+
+#endif /* _462_SAMPLER_HPP_ */
@@ -11,8 +11,14 @@
 
 namespace _462 {
 
-// floating point precision set by this typedef
+// floating point precision set by this typedef. Building everything with
+// REAL_FLOAT defined renders in single precision, which halves the size of
+// the vectors, matrices and colors and doubles the width of SIMD code.
+#ifdef REAL_FLOAT
+typedef float real_t;
+#else
 typedef double real_t;
+#endif
 
 class Color3;
 
@@ -0,0 +1,131 @@
+/**
+ * @file matrix_batch.hpp
+ * @brief Matrix4 transforms over arrays of points and vectors.
+ */
+
+#ifndef _462_MATH_MATRIX_BATCH_HPP_
+#define _462_MATH_MATRIX_BATCH_HPP_
+
+#include "math/matrix.hpp"
+#include "math/simd.hpp"
+
+namespace _462 {
+
+/*
+Like vector_batch.hpp, these take n points or vectors as structure of
+arrays and give the same values as Matrix4::transform_point and
+Matrix4::transform_vector. The output arrays may be the input arrays, so
+a batch can be transformed in place, but must not overlap them otherwise.
+*/
+
+/**
+ * Whether the bottom row of m is ( 0, 0, 0, 1 ), so that transformed
+ * points keep w = 1 and need no homogeneous divide.
+ */
+inline bool is_affine( const Matrix4& m )
+{
+    return m._m[0][3] == 0 && m._m[1][3] == 0 && m._m[2][3] == 0 && m._m[3][3] == 1;
+}
+
+/**
+ * out[i] = m.transform_point( p[i] ). Affine matrices skip the divide by w.
+ */
+inline void transform_points_n( const Matrix4& m,
+                                const real_t* x, const real_t* y, const real_t* z,
+                                real_t* out_x, real_t* out_y, real_t* out_z, size_t n )
+{
+    const real_t ( *c )[4] = m._m;
+    size_t i = 0;
+
+    if ( is_affine( m ) ) {
+        // with w = 1, the translation is added as is and w stays 1
+#ifdef SIMD_LANES
+        Lanes m00 = lanes_set( c[0][0] ), m10 = lanes_set( c[1][0] ), m20 = lanes_set( c[2][0] ), m30 = lanes_set( c[3][0] );
+        Lanes m01 = lanes_set( c[0][1] ), m11 = lanes_set( c[1][1] ), m21 = lanes_set( c[2][1] ), m31 = lanes_set( c[3][1] );
+        Lanes m02 = lanes_set( c[0][2] ), m12 = lanes_set( c[1][2] ), m22 = lanes_set( c[2][2] ), m32 = lanes_set( c[3][2] );
+        for ( ; i + SIMD_LANES <= n; i += SIMD_LANES ) {
+            Lanes px = lanes_load( x + i ), py = lanes_load( y + i ), pz = lanes_load( z + i );
+            lanes_store( out_x + i, lanes_add( lanes_add( lanes_add( lanes_mul( m00, px ), lanes_mul( m10, py ) ),
+                                                          lanes_mul( m20, pz ) ), m30 ) );
+            lanes_store( out_y + i, lanes_add( lanes_add( lanes_add( lanes_mul( m01, px ), lanes_mul( m11, py ) ),
+                                                          lanes_mul( m21, pz ) ), m31 ) );
+            lanes_store( out_z + i, lanes_add( lanes_add( lanes_add( lanes_mul( m02, px ), lanes_mul( m12, py ) ),
+                                                          lanes_mul( m22, pz ) ), m32 ) );
+        }
+#endif
+        for ( ; i < n; i++ ) {
+            real_t px = x[i], py = y[i], pz = z[i];
+            out_x[i] = c[0][0] * px + c[1][0] * py + c[2][0] * pz + c[3][0];
+            out_y[i] = c[0][1] * px + c[1][1] * py + c[2][1] * pz + c[3][1];
+            out_z[i] = c[0][2] * px + c[1][2] * py + c[2][2] * pz + c[3][2];
+        }
+        return;
+    }
+
+#ifdef SIMD_LANES
+    Lanes m00 = lanes_set( c[0][0] ), m10 = lanes_set( c[1][0] ), m20 = lanes_set( c[2][0] ), m30 = lanes_set( c[3][0] );
+    Lanes m01 = lanes_set( c[0][1] ), m11 = lanes_set( c[1][1] ), m21 = lanes_set( c[2][1] ), m31 = lanes_set( c[3][1] );
+    Lanes m02 = lanes_set( c[0][2] ), m12 = lanes_set( c[1][2] ), m22 = lanes_set( c[2][2] ), m32 = lanes_set( c[3][2] );
+    Lanes m03 = lanes_set( c[0][3] ), m13 = lanes_set( c[1][3] ), m23 = lanes_set( c[2][3] ), m33 = lanes_set( c[3][3] );
+    Lanes zero = lanes_set( 0 ), one = lanes_set( 1 );
+    for ( ; i + SIMD_LANES <= n; i += SIMD_LANES ) {
+        Lanes px = lanes_load( x + i ), py = lanes_load( y + i ), pz = lanes_load( z + i );
+        Lanes tx = lanes_add( lanes_add( lanes_add( lanes_mul( m00, px ), lanes_mul( m10, py ) ),
+                                         lanes_mul( m20, pz ) ), m30 );
+        Lanes ty = lanes_add( lanes_add( lanes_add( lanes_mul( m01, px ), lanes_mul( m11, py ) ),
+                                         lanes_mul( m21, pz ) ), m31 );
+        Lanes tz = lanes_add( lanes_add( lanes_add( lanes_mul( m02, px ), lanes_mul( m12, py ) ),
+                                         lanes_mul( m22, pz ) ), m32 );
+        Lanes tw = lanes_add( lanes_add( lanes_add( lanes_mul( m03, px ), lanes_mul( m13, py ) ),
+                                         lanes_mul( m23, pz ) ), m33 );
+        // as in project(), points at infinity are left undivided
+        Lanes winv = lanes_select( lanes_equal( tw, zero ), one, lanes_div( one, tw ) );
+        lanes_store( out_x + i, lanes_mul( tx, winv ) );
+        lanes_store( out_y + i, lanes_mul( ty, winv ) );
+        lanes_store( out_z + i, lanes_mul( tz, winv ) );
+    }
+#endif
+    for ( ; i < n; i++ ) {
+        real_t px = x[i], py = y[i], pz = z[i];
+        real_t tw = c[0][3] * px + c[1][3] * py + c[2][3] * pz + c[3][3];
+        real_t winv = tw == 0 ? real_t( 1 ) : real_t( 1 ) / tw;
+        out_x[i] = ( c[0][0] * px + c[1][0] * py + c[2][0] * pz + c[3][0] ) * winv;
+        out_y[i] = ( c[0][1] * px + c[1][1] * py + c[2][1] * pz + c[3][1] ) * winv;
+        out_z[i] = ( c[0][2] * px + c[1][2] * py + c[2][2] * pz + c[3][2] ) * winv;
+    }
+}
+
+/**
+ * out[i] = m.transform_vector( v[i] ).
+ */
+inline void transform_vectors_n( const Matrix4& m,
+                                 const real_t* x, const real_t* y, const real_t* z,
+                                 real_t* out_x, real_t* out_y, real_t* out_z, size_t n )
+{
+    const real_t ( *c )[4] = m._m;
+    size_t i = 0;
+#ifdef SIMD_LANES
+    Lanes m00 = lanes_set( c[0][0] ), m10 = lanes_set( c[1][0] ), m20 = lanes_set( c[2][0] );
+    Lanes m01 = lanes_set( c[0][1] ), m11 = lanes_set( c[1][1] ), m21 = lanes_set( c[2][1] );
+    Lanes m02 = lanes_set( c[0][2] ), m12 = lanes_set( c[1][2] ), m22 = lanes_set( c[2][2] );
+    for ( ; i + SIMD_LANES <= n; i += SIMD_LANES ) {
+        Lanes vx = lanes_load( x + i ), vy = lanes_load( y + i ), vz = lanes_load( z + i );
+        lanes_store( out_x + i, lanes_add( lanes_add( lanes_mul( m00, vx ), lanes_mul( m10, vy ) ),
+                                           lanes_mul( m20, vz ) ) );
+        lanes_store( out_y + i, lanes_add( lanes_add( lanes_mul( m01, vx ), lanes_mul( m11, vy ) ),
+                                           lanes_mul( m21, vz ) ) );
+        lanes_store( out_z + i, lanes_add( lanes_add( lanes_mul( m02, vx ), lanes_mul( m12, vy ) ),
+                                           lanes_mul( m22, vz ) ) );
+    }
+#endif
+    for ( ; i < n; i++ ) {
+        real_t vx = x[i], vy = y[i], vz = z[i];
+        out_x[i] = c[0][0] * vx + c[1][0] * vy + c[2][0] * vz;
+        out_y[i] = c[0][1] * vx + c[1][1] * vy + c[2][1] * vz;
+        out_z[i] = c[0][2] * vx + c[1][2] * vy + c[2][2] * vz;
+    }
+}
+
+} /* _462 */
+
+#endif /* _462_MATH_MATRIX_BATCH_HPP_ */
@@ -0,0 +1,266 @@
+/**
+ * @file sampling.hpp
+ * @brief Random numbers and their mappings to points and directions.
+ */
+
+#ifndef _462_MATH_SAMPLING_HPP_
+#define _462_MATH_SAMPLING_HPP_
+
+#include "math/vector.hpp"
+#include "math/simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace _462 {
+
+/**
+ * O'Neill's PCG32 generator: 64 bits of state, 32 random bits per step
+ * from one multiply, add and rotate. Generators with different streams
+ * are independent.
+ */
+class Pcg32
+{
+public:
+
+    explicit Pcg32( unsigned long long seed = 0x853c49e6748fea9bull,
+                    unsigned long long stream = 0xda3e39cb94b95bdbull )
+    {
+        state = 0;
+        inc = ( stream << 1 ) | 1;
+        next_uint();
+        state += seed;
+        next_uint();
+    }
+
+    unsigned int next_uint()
+    {
+        unsigned long long old = state;
+        state = old * 6364136223846793005ull + inc;
+        unsigned int x = (unsigned int)( ( ( old >> 18 ) ^ old ) >> 27 );
+        unsigned int rot = (unsigned int)( old >> 59 );
+        return ( x >> rot ) | ( x << ( ( 32 - rot ) & 31 ) );
+    }
+
+    /// uniform in [0, 1), from as many bits as real_t holds exactly
+    real_t next_real()
+    {
+        static const int bits = std::numeric_limits<real_t>::digits < 32 ?
+                                std::numeric_limits<real_t>::digits : 32;
+        return ( next_uint() >> ( 32 - bits ) ) * ( real_t( 1 ) / ( 1ull << bits ) );
+    }
+
+private:
+
+    unsigned long long state;
+    unsigned long long inc;
+};
+
+/*
+The mappings take uniform ( u, v ) in [0, 1)^2, from a Pcg32 or a
+structured sampler, and keep their stratification. Directions around an
+axis use the same frame for the same axis.
+*/
+
+/**
+ * Two directions that make an orthonormal frame with the unit vector axis.
+ */
+inline void make_frame( const Vector3& axis, Vector3& a, Vector3& b )
+{
+    a = normalize( cross( fabs( axis.x ) > 0.5 ? Vector3( 0, 1, 0 ) : Vector3( 1, 0, 0 ), axis ) );
+    b = cross( axis, a );
+}
+
+/**
+ * The vector with coordinates local in the frame of axis, z along axis.
+ */
+inline Vector3 from_frame( const Vector3& axis, const Vector3& local )
+{
+    Vector3 a, b;
+    make_frame( axis, a, b );
+    return a * local.x + b * local.y + axis * local.z;
+}
+
+/**
+ * The direction at cos_theta from axis and angle 2*PI*v around it.
+ */
+inline Vector3 direction_around( const Vector3& axis, real_t cos_theta, real_t v )
+{
+    real_t r = sqrt( std::max( real_t( 0 ), 1 - cos_theta * cos_theta ) );
+    real_t phi = 2 * PI * v;
+    return from_frame( axis, Vector3( r * cos( phi ), r * sin( phi ), cos_theta ) );
+}
+
+/**
+ * Shirley and Chiu's concentric map from the unit square to the unit disk,
+ * which keeps neighboring samples together.
+ */
+inline void sample_concentric_disk( real_t u, real_t v, real_t& x, real_t& y )
+{
+    real_t a = 2 * u - 1;
+    real_t b = 2 * v - 1;
+    if ( a == 0 && b == 0 ) {
+        x = y = 0;
+        return;
+    }
+    real_t r, phi;
+    if ( fabs( a ) > fabs( b ) ) {
+        r = a;
+        phi = real_t( PI / 4 ) * ( b / a );
+    } else {
+        r = b;
+        phi = real_t( PI / 2 ) - real_t( PI / 4 ) * ( a / b );
+    }
+    x = r * cos( phi );
+    y = r * sin( phi );
+}
+
+inline Vector3 sample_uniform_sphere( real_t u, real_t v )
+{
+    real_t z = 1 - 2 * u;
+    real_t r = sqrt( std::max( real_t( 0 ), 1 - z * z ) );
+    real_t phi = 2 * PI * v;
+    return Vector3( r * cos( phi ), r * sin( phi ), z );
+}
+
+inline Vector3 sample_uniform_hemisphere( const Vector3& normal, real_t u, real_t v )
+{
+    return direction_around( normal, u, v );
+}
+
+/**
+ * pdf cos(theta)/PI around normal, by Malley's method: a uniform point on
+ * the disk, lifted up to the hemisphere.
+ */
+inline Vector3 sample_cosine_hemisphere( const Vector3& normal, real_t u, real_t v )
+{
+    real_t x, y;
+    sample_concentric_disk( u, v, x, y );
+    real_t z = sqrt( std::max( real_t( 0 ), 1 - x * x - y * y ) );
+    return from_frame( normal, Vector3( x, y, z ) );
+}
+
+/**
+ * Uniform in solid angle within acos(cos_theta_max) of axis.
+ */
+inline Vector3 sample_cone( const Vector3& axis, real_t cos_theta_max, real_t u, real_t v )
+{
+    return direction_around( axis, 1 - u * ( 1 - cos_theta_max ), v );
+}
+
+/**
+ * Fills x, y and z with n directions from points ( a, b ) uniform in the
+ * unit disk, with s = a^2 + b^2. If sphere, the directions are uniform on
+ * the sphere by Marsaglia's method, ( 2a sqrt(1 - s), 2b sqrt(1 - s),
+ * 1 - 2s ). Otherwise they follow cos(theta)/PI around +z by Malley's
+ * method, ( a, b, sqrt(1 - s) ). The points are drawn from the square and
+ * rejected outside the disk, so there are no sines or cosines, and
+ * SIMD_LANES candidates are mapped at once.
+ */
+inline void sample_disk_directions_n( Pcg32& random, bool sphere,
+                                      real_t* x, real_t* y, real_t* z, size_t n )
+{
+    size_t i = 0;
+#ifdef SIMD_LANES
+    real_t a[SIMD_LANES], b[SIMD_LANES];
+    real_t dx[SIMD_LANES], dy[SIMD_LANES], dz[SIMD_LANES];
+    Lanes one = lanes_set( 1 ), two = lanes_set( 2 );
+    // at most SIMD_LANES candidates are kept per round
+    while ( i + SIMD_LANES <= n ) {
+        for ( int k = 0; k < SIMD_LANES; k++ ) {
+            a[k] = 2 * random.next_real() - 1;
+            b[k] = 2 * random.next_real() - 1;
+        }
+        Lanes la = lanes_load( a ), lb = lanes_load( b );
+        Lanes s = lanes_add( lanes_mul( la, la ), lanes_mul( lb, lb ) );
+        int inside = lanes_mask( lanes_less( s, one ) );
+        // rejected lanes may take the root of a negative number
+        Lanes w = lanes_sqrt( lanes_sub( one, s ) );
+        if ( sphere ) {
+            Lanes scale = lanes_mul( two, w );
+            lanes_store( dx, lanes_mul( la, scale ) );
+            lanes_store( dy, lanes_mul( lb, scale ) );
+            lanes_store( dz, lanes_sub( one, lanes_mul( two, s ) ) );
+        } else {
+            lanes_store( dx, la );
+            lanes_store( dy, lb );
+            lanes_store( dz, w );
+        }
+        for ( int k = 0; k < SIMD_LANES; k++ ) {
+            if ( inside & ( 1 << k ) ) {
+                x[i] = dx[k];
+                y[i] = dy[k];
+                z[i] = dz[k];
+                i++;
+            }
+        }
+    }
+#endif
+    while ( i < n ) {
+        real_t a = 2 * random.next_real() - 1;
+        real_t b = 2 * random.next_real() - 1;
+        real_t s = a * a + b * b;
+        if ( s >= 1 )
+            continue;
+        real_t w = sqrt( 1 - s );
+        if ( sphere ) {
+            x[i] = a * ( 2 * w );
+            y[i] = b * ( 2 * w );
+            z[i] = 1 - 2 * s;
+        } else {
+            x[i] = a;
+            y[i] = b;
+            z[i] = w;
+        }
+        i++;
+    }
+}
+
+inline void sample_uniform_sphere_n( Pcg32& random, real_t* x, real_t* y, real_t* z, size_t n )
+{
+    sample_disk_directions_n( random, true, x, y, z, n );
+}
+
+/// around +z, to be moved to a normal with from_frame
+inline void sample_cosine_hemisphere_n( Pcg32& random, real_t* x, real_t* y, real_t* z, size_t n )
+{
+    sample_disk_directions_n( random, false, x, y, z, n );
+}
+
+/**
+ * Hands out the directions of one of the bulk functions one at a time,
+ * generating DIRECTION_BATCH_SIZE of them at once.
+ */
+class DirectionBatch
+{
+public:
+
+    typedef void ( *Generator )( Pcg32&, real_t*, real_t*, real_t*, size_t );
+
+    static const size_t DIRECTION_BATCH_SIZE = 256;
+
+    explicit DirectionBatch( Generator generate )
+        : generate( generate ), next( DIRECTION_BATCH_SIZE ) {}
+
+    Vector3 get( Pcg32& random )
+    {
+        if ( next == DIRECTION_BATCH_SIZE ) {
+            generate( random, x, y, z, DIRECTION_BATCH_SIZE );
+            next = 0;
+        }
+        Vector3 d( x[next], y[next], z[next] );
+        next++;
+        return d;
+    }
+
+private:
+
+    Generator generate;
+    size_t next;
+    real_t x[DIRECTION_BATCH_SIZE], y[DIRECTION_BATCH_SIZE], z[DIRECTION_BATCH_SIZE];
+};
+
+} /* _462 */
+
+#endif /* _462_MATH_SAMPLING_HPP_ */
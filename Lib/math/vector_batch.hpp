@@ -0,0 +1,150 @@
+/**
+ * @file vector_batch.hpp
+ * @brief Vector3 operations over arrays of vectors.
+ */
+
+#ifndef _462_MATH_VECTOR_BATCH_HPP_
+#define _462_MATH_VECTOR_BATCH_HPP_
+
+#include "math/vector.hpp"
+#include "math/simd.hpp"
+
+namespace _462 {
+
+/*
+These functions work on n vectors stored as structure of arrays: the
+components of vector i are x[i], y[i] and z[i]. Groups of SIMD_LANES
+vectors are processed at once, the rest one by one. Each result has the
+same bits as the scalar function of vector.hpp, so both can be mixed and
+tested against each other.
+*/
+
+/**
+ * out[i] = dot( a[i], b[i] ).
+ */
+inline void dot_n( const real_t* ax, const real_t* ay, const real_t* az,
+                   const real_t* bx, const real_t* by, const real_t* bz,
+                   real_t* out, size_t n )
+{
+    size_t i = 0;
+#ifdef SIMD_LANES
+    for ( ; i + SIMD_LANES <= n; i += SIMD_LANES ) {
+        Lanes d = lanes_add( lanes_add( lanes_mul( lanes_load( ax + i ), lanes_load( bx + i ) ),
+                                        lanes_mul( lanes_load( ay + i ), lanes_load( by + i ) ) ),
+                             lanes_mul( lanes_load( az + i ), lanes_load( bz + i ) ) );
+        lanes_store( out + i, d );
+    }
+#endif
+    for ( ; i < n; i++ )
+        out[i] = ax[i] * bx[i] + ay[i] * by[i] + az[i] * bz[i];
+}
+
+/**
+ * out[i] = dot( a[i], v ).
+ */
+inline void dot_n( const real_t* ax, const real_t* ay, const real_t* az,
+                   const Vector3& v, real_t* out, size_t n )
+{
+    size_t i = 0;
+#ifdef SIMD_LANES
+    Lanes vx = lanes_set( v.x ), vy = lanes_set( v.y ), vz = lanes_set( v.z );
+    for ( ; i + SIMD_LANES <= n; i += SIMD_LANES ) {
+        Lanes d = lanes_add( lanes_add( lanes_mul( lanes_load( ax + i ), vx ),
+                                        lanes_mul( lanes_load( ay + i ), vy ) ),
+                             lanes_mul( lanes_load( az + i ), vz ) );
+        lanes_store( out + i, d );
+    }
+#endif
+    for ( ; i < n; i++ )
+        out[i] = ax[i] * v.x + ay[i] * v.y + az[i] * v.z;
+}
+
+/**
+ * out[i] = cross( a[i], b[i] ). out may not alias a or b.
+ */
+inline void cross_n( const real_t* ax, const real_t* ay, const real_t* az,
+                     const real_t* bx, const real_t* by, const real_t* bz,
+                     real_t* out_x, real_t* out_y, real_t* out_z, size_t n )
+{
+    size_t i = 0;
+#ifdef SIMD_LANES
+    for ( ; i + SIMD_LANES <= n; i += SIMD_LANES ) {
+        Lanes lx = lanes_load( ax + i ), ly = lanes_load( ay + i ), lz = lanes_load( az + i );
+        Lanes rx = lanes_load( bx + i ), ry = lanes_load( by + i ), rz = lanes_load( bz + i );
+        lanes_store( out_x + i, lanes_sub( lanes_mul( ly, rz ), lanes_mul( lz, ry ) ) );
+        lanes_store( out_y + i, lanes_sub( lanes_mul( lz, rx ), lanes_mul( lx, rz ) ) );
+        lanes_store( out_z + i, lanes_sub( lanes_mul( lx, ry ), lanes_mul( ly, rx ) ) );
+    }
+#endif
+    for ( ; i < n; i++ ) {
+        out_x[i] = ay[i] * bz[i] - az[i] * by[i];
+        out_y[i] = az[i] * bx[i] - ax[i] * bz[i];
+        out_z[i] = ax[i] * by[i] - ay[i] * bx[i];
+    }
+}
+
+/**
+ * Normalizes the n vectors in place.
+ */
+inline void normalize_n( real_t* x, real_t* y, real_t* z, size_t n )
+{
+    size_t i = 0;
+#ifdef SIMD_LANES
+    Lanes one = lanes_set( 1 );
+    for ( ; i + SIMD_LANES <= n; i += SIMD_LANES ) {
+        Lanes vx = lanes_load( x + i ), vy = lanes_load( y + i ), vz = lanes_load( z + i );
+        Lanes squared = lanes_add( lanes_add( lanes_mul( vx, vx ), lanes_mul( vy, vy ) ), lanes_mul( vz, vz ) );
+        Lanes inv = lanes_div( one, lanes_sqrt( squared ) );
+        lanes_store( x + i, lanes_mul( vx, inv ) );
+        lanes_store( y + i, lanes_mul( vy, inv ) );
+        lanes_store( z + i, lanes_mul( vz, inv ) );
+    }
+#endif
+    for ( ; i < n; i++ ) {
+        Vector3 v = normalize( Vector3( x[i], y[i], z[i] ) );
+        x[i] = v.x;
+        y[i] = v.y;
+        z[i] = v.z;
+    }
+}
+
+/**
+ * out[i] = squared_distance( a[i], p ).
+ */
+inline void squared_distance_n( const real_t* ax, const real_t* ay, const real_t* az,
+                                const Vector3& p, real_t* out, size_t n )
+{
+    size_t i = 0;
+#ifdef SIMD_LANES
+    Lanes px = lanes_set( p.x ), py = lanes_set( p.y ), pz = lanes_set( p.z );
+    for ( ; i + SIMD_LANES <= n; i += SIMD_LANES ) {
+        Lanes dx = lanes_sub( lanes_load( ax + i ), px );
+        Lanes dy = lanes_sub( lanes_load( ay + i ), py );
+        Lanes dz = lanes_sub( lanes_load( az + i ), pz );
+        lanes_store( out + i, lanes_add( lanes_add( lanes_mul( dx, dx ), lanes_mul( dy, dy ) ),
+                                         lanes_mul( dz, dz ) ) );
+    }
+#endif
+    for ( ; i < n; i++ )
+        out[i] = squared_distance( Vector3( ax[i], ay[i], az[i] ), p );
+}
+
+/**
+ * out[i] = distance( a[i], p ).
+ */
+inline void distance_n( const real_t* ax, const real_t* ay, const real_t* az,
+                        const Vector3& p, real_t* out, size_t n )
+{
+    squared_distance_n( ax, ay, az, p, out, n );
+    size_t i = 0;
+#ifdef SIMD_LANES
+    for ( ; i + SIMD_LANES <= n; i += SIMD_LANES )
+        lanes_store( out + i, lanes_sqrt( lanes_load( out + i ) ) );
+#endif
+    for ( ; i < n; i++ )
+        out[i] = sqrt( out[i] );
+}
+
+} /* _462 */
+
+#endif /* _462_MATH_VECTOR_BATCH_HPP_ */
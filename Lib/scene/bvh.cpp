@@ -0,0 +1,498 @@
+/**
+ * @file bvh.cpp
+ * @brief Bounding volume hierarchy over the geometries of a scene.
+ */
+
+#include "scene/bvh.hpp"
+#include "scene/sphere.hpp"
+#include "scene/triangle.hpp"
+#include "scene/model.hpp"
+#include "math/simd.hpp"
+#include "math/matrix_batch.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace _462 {
+
+SceneBVH::SceneBVH() : root( -1 ), geometries( 0 ) {}
+
+void SceneBVH::add_triangle( TriangleArray& list, std::vector<Reference>& refs,
+                             const Vector3 p[3], int geometry, int index )
+{
+    Reference ref;
+    ref.min = vmin( p[0], vmin( p[1], p[2] ) );
+    ref.max = vmax( p[0], vmax( p[1], p[2] ) );
+    ref.center = ( ref.min + ref.max )*0.5;
+    ref.index = list.geometry.size();
+    refs.push_back( ref );
+
+    list.p0.push_back( p[0] );
+    list.edge1.push_back( p[1] - p[0] );
+    list.edge2.push_back( p[2] - p[0] );
+    list.geometry.push_back( geometry );
+    list.index.push_back( index );
+}
+
+void SceneBVH::build( Geometry* const* geometries, size_t num_geometries )
+{
+    this->geometries = geometries;
+    nodes.clear();
+    root = -1;
+    spheres = SphereArray();
+    ellipsoids = EllipsoidArray();
+    triangles = TriangleArray();
+    others.clear();
+
+    // the primitives of each type in scene order
+    SphereArray sphere_list;
+    EllipsoidArray ellipsoid_list;
+    TriangleArray triangle_list;
+    std::vector<int> other_list;
+    std::vector<Reference> refs[NUM_PRIMITIVE_TYPES];
+    // vertices of the current model in world space
+    std::vector<real_t> world_x, world_y, world_z;
+
+    for ( size_t i = 0; i < num_geometries; i++ ) {
+        const Geometry* geometry = geometries[i];
+
+        if ( const Sphere* sphere = dynamic_cast<const Sphere*>( geometry ) ) {
+            // rotation leaves a sphere a sphere, so does a uniform scale
+            const Vector3& scale = sphere->scale;
+            Reference ref;
+            if ( scale.x == scale.y && scale.x == scale.z ) {
+                real_t radius = sphere->radius*fabs( scale.x );
+                Vector3 extent( radius, radius, radius );
+                ref.min = sphere->position - extent;
+                ref.max = sphere->position + extent;
+                ref.center = sphere->position;
+                ref.index = sphere_list.geometry.size();
+                refs[PRIMITIVE_SPHERE].push_back( ref );
+
+                sphere_list.center_x.push_back( sphere->position.x );
+                sphere_list.center_y.push_back( sphere->position.y );
+                sphere_list.center_z.push_back( sphere->position.z );
+                sphere_list.radius2.push_back( radius*radius );
+                sphere_list.geometry.push_back( i );
+            } else {
+                sphere->get_bounds( &ref.min, &ref.max );
+                ref.center = ( ref.min + ref.max )*0.5;
+                ref.index = ellipsoid_list.geometry.size();
+                refs[PRIMITIVE_ELLIPSOID].push_back( ref );
+
+                ellipsoid_list.inv_mat.push_back( sphere->invMat );
+                ellipsoid_list.radius2.push_back( sphere->radius*sphere->radius );
+                ellipsoid_list.geometry.push_back( i );
+            }
+
+        } else if ( const Triangle* triangle = dynamic_cast<const Triangle*>( geometry ) ) {
+            Vector3 p[3];
+            for ( int k = 0; k < 3; k++ )
+                p[k] = triangle->mat.transform_point( triangle->vertices[k].position );
+            add_triangle( triangle_list, refs[PRIMITIVE_TRIANGLE], p, i, -1 );
+
+        } else if ( const Model* model = dynamic_cast<const Model*>( geometry ) ) {
+            if ( !model->mesh || !model->mesh->num_vertices() )
+                continue;
+            // move each vertex to world space once, rather than once per face
+            const MeshVertex* vertices = model->mesh->get_vertices();
+            size_t num_vertices = model->mesh->num_vertices();
+            world_x.resize( num_vertices );
+            world_y.resize( num_vertices );
+            world_z.resize( num_vertices );
+            for ( size_t j = 0; j < num_vertices; j++ ) {
+                world_x[j] = vertices[j].position.x;
+                world_y[j] = vertices[j].position.y;
+                world_z[j] = vertices[j].position.z;
+            }
+            transform_points_n( model->mat, &world_x[0], &world_y[0], &world_z[0],
+                                &world_x[0], &world_y[0], &world_z[0], num_vertices );
+
+            const MeshTriangle* faces = model->mesh->get_triangles();
+            for ( size_t j = 0; j < model->mesh->num_triangles(); j++ ) {
+                Vector3 p[3];
+                for ( int k = 0; k < 3; k++ ) {
+                    unsigned int v = faces[j].vertices[k];
+                    p[k] = Vector3( world_x[v], world_y[v], world_z[v] );
+                }
+                add_triangle( triangle_list, refs[PRIMITIVE_TRIANGLE], p, i, j );
+            }
+
+        } else {
+            Reference ref;
+            geometry->get_bounds( &ref.min, &ref.max );
+            ref.center = ( ref.min + ref.max )*0.5;
+            ref.index = other_list.size();
+            refs[PRIMITIVE_GEOMETRY].push_back( ref );
+            other_list.push_back( i );
+        }
+    }
+
+    // one subtree per type, joined at the top
+    for ( int type = 0; type < NUM_PRIMITIVE_TYPES; type++ ) {
+        if ( refs[type].empty() )
+            continue;
+        int subtree = build_node( PrimitiveType( type ), refs[type], 0, refs[type].size() );
+        if ( root < 0 ) {
+            root = subtree;
+            continue;
+        }
+        Node node;
+        node.min = vmin( nodes[root].min, nodes[subtree].min );
+        node.max = vmax( nodes[root].max, nodes[subtree].max );
+        node.left = root;
+        node.right = subtree;
+        node.axis = 0;
+        node.type = PRIMITIVE_GEOMETRY;
+        node.first = node.count = 0;
+        root = nodes.size();
+        nodes.push_back( node );
+    }
+
+    // lay out the primitives in the order of the leaves
+    const std::vector<Reference>& sphere_refs = refs[PRIMITIVE_SPHERE];
+    for ( size_t k = 0; k < sphere_refs.size(); k++ ) {
+        size_t j = sphere_refs[k].index;
+        spheres.center_x.push_back( sphere_list.center_x[j] );
+        spheres.center_y.push_back( sphere_list.center_y[j] );
+        spheres.center_z.push_back( sphere_list.center_z[j] );
+        spheres.radius2.push_back( sphere_list.radius2[j] );
+        spheres.geometry.push_back( sphere_list.geometry[j] );
+    }
+    const std::vector<Reference>& ellipsoid_refs = refs[PRIMITIVE_ELLIPSOID];
+    for ( size_t k = 0; k < ellipsoid_refs.size(); k++ ) {
+        size_t j = ellipsoid_refs[k].index;
+        ellipsoids.inv_mat.push_back( ellipsoid_list.inv_mat[j] );
+        ellipsoids.radius2.push_back( ellipsoid_list.radius2[j] );
+        ellipsoids.geometry.push_back( ellipsoid_list.geometry[j] );
+    }
+    const std::vector<Reference>& triangle_refs = refs[PRIMITIVE_TRIANGLE];
+    for ( size_t k = 0; k < triangle_refs.size(); k++ ) {
+        size_t j = triangle_refs[k].index;
+        triangles.p0.push_back( triangle_list.p0[j] );
+        triangles.edge1.push_back( triangle_list.edge1[j] );
+        triangles.edge2.push_back( triangle_list.edge2[j] );
+        triangles.geometry.push_back( triangle_list.geometry[j] );
+        triangles.index.push_back( triangle_list.index[j] );
+    }
+    const std::vector<Reference>& other_refs = refs[PRIMITIVE_GEOMETRY];
+    for ( size_t k = 0; k < other_refs.size(); k++ )
+        others.push_back( other_list[other_refs[k].index] );
+}
+
+int SceneBVH::build_node( PrimitiveType type, std::vector<Reference>& refs, size_t begin, size_t end )
+{
+    int index = nodes.size();
+    nodes.push_back( Node() );
+
+    Node node;
+    node.min = refs[begin].min;
+    node.max = refs[begin].max;
+    Vector3 center_min = refs[begin].center;
+    Vector3 center_max = center_min;
+    for ( size_t i = begin + 1; i < end; i++ ) {
+        node.min = vmin( node.min, refs[i].min );
+        node.max = vmax( node.max, refs[i].max );
+        center_min = vmin( center_min, refs[i].center );
+        center_max = vmax( center_max, refs[i].center );
+    }
+    node.type = type;
+
+    size_t leaf_size = type == PRIMITIVE_SPHERE ? BVH_SPHERE_LEAF_SIZE : BVH_LEAF_SIZE;
+    if ( end - begin <= leaf_size ) {
+        node.left = node.right = -1;
+        node.axis = 0;
+        node.first = begin;
+        node.count = end - begin;
+        nodes[index] = node;
+        return index;
+    }
+
+    // split at the median along the longest extent of the centers
+    Vector3 extent = center_max - center_min;
+    int axis = extent.x > extent.y ? ( extent.x > extent.z ? 0 : 2 ) : ( extent.y > extent.z ? 1 : 2 );
+    size_t mid = begin + ( end - begin )/2;
+    std::nth_element( refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                      [axis]( const Reference& a, const Reference& b ) {
+                          return a.center[axis] < b.center[axis];
+                      } );
+
+    node.axis = axis;
+    node.first = node.count = 0;
+    node.left = build_node( type, refs, begin, mid );
+    node.right = build_node( type, refs, mid, end );
+    nodes[index] = node;
+    return index;
+}
+
+// whether the ray e + t*d with inv_d = 1/d enters the box for a t in
+// [0, t_max]. Axes the ray runs parallel to within a slab give NaNs,
+// which the min and max skip.
+static inline bool hit_box( const Vector3& min, const Vector3& max, const Vector3& e,
+                            const Vector3& inv_d, real_t t_max )
+{
+    real_t t0 = 0;
+    real_t t1 = t_max;
+    for ( int axis = 0; axis < 3; axis++ ) {
+        real_t near = ( min[axis] - e[axis] )*inv_d[axis];
+        real_t far = ( max[axis] - e[axis] )*inv_d[axis];
+        if ( near > far )
+            std::swap( near, far );
+        t0 = std::max( t0, near );
+        t1 = std::min( t1, far );
+    }
+    return t0 <= t1;
+}
+
+/*
+ * The closest of spheres [first, end) hit before t_max, or with any_hit
+ * the first one found, with the offsets of Sphere::checkIntersection.
+ * Whole groups of SIMD_LANES spheres are tested at once.
+ */
+inline bool SceneBVH::intersect_spheres( unsigned int first, unsigned int end, const Ray& r, real_t offset,
+                                         real_t t_max, bool any_hit, real_t& t, unsigned int& hit ) const
+{
+    const real_t* center_x = &spheres.center_x[0];
+    const real_t* center_y = &spheres.center_y[0];
+    const real_t* center_z = &spheres.center_z[0];
+    const real_t* radius2 = &spheres.radius2[0];
+    real_t A = dot( r.d, r.d );
+    real_t t1_min = SPHERE_EPSILON + offset;
+    real_t t2_min = SPHERE_FAR_EPSILON + offset;
+    bool found = false;
+    unsigned int i = first;
+
+#ifdef SIMD_LANES
+    Lanes ex = lanes_set( r.e.x ), ey = lanes_set( r.e.y ), ez = lanes_set( r.e.z );
+    Lanes dx = lanes_set( r.d.x ), dy = lanes_set( r.d.y ), dz = lanes_set( r.d.z );
+    Lanes a = lanes_set( A );
+    Lanes zero = lanes_set( 0 );
+    Lanes near_min = lanes_set( t1_min );
+    Lanes far_min = lanes_set( t2_min );
+    for ( ; i + SIMD_LANES <= end; i += SIMD_LANES ) {
+        Lanes ox = lanes_sub( ex, lanes_load( center_x + i ) );
+        Lanes oy = lanes_sub( ey, lanes_load( center_y + i ) );
+        Lanes oz = lanes_sub( ez, lanes_load( center_z + i ) );
+        Lanes B = lanes_add( lanes_add( lanes_mul( dx, ox ), lanes_mul( dy, oy ) ), lanes_mul( dz, oz ) );
+        Lanes C = lanes_add( lanes_add( lanes_mul( ox, ox ), lanes_mul( oy, oy ) ), lanes_mul( oz, oz ) );
+        C = lanes_sub( C, lanes_load( radius2 + i ) );
+        Lanes discriminant = lanes_sub( lanes_mul( B, B ), lanes_mul( a, C ) );
+        // most rays miss every sphere of a leaf
+        Lanes real = lanes_greater_equal( discriminant, zero );
+        if ( !lanes_mask( real ) )
+            continue;
+
+        Lanes root = lanes_sqrt( lanes_max( discriminant, zero ) );
+        Lanes t1 = lanes_div( lanes_sub( lanes_sub( zero, B ), root ), a );
+        Lanes t2 = lanes_div( lanes_sub( root, B ), a );
+
+        Lanes limit = lanes_set( t_max );
+        Lanes hit1 = lanes_and( real, lanes_and( lanes_less( near_min, t1 ), lanes_less( t1, limit ) ) );
+        Lanes hit2 = lanes_and( real, lanes_and( lanes_less( far_min, t2 ), lanes_less( t2, limit ) ) );
+        int mask = lanes_mask( lanes_or( hit1, hit2 ) );
+        if ( !mask )
+            continue;
+
+        real_t lane_t[SIMD_LANES];
+        lanes_store( lane_t, lanes_select( hit1, t1, t2 ) );
+        for ( int k = 0; k < SIMD_LANES; k++ ) {
+            if ( ( mask >> k & 1 ) && lane_t[k] < t_max ) {
+                t_max = t = lane_t[k];
+                hit = i + k;
+                found = true;
+            }
+        }
+        if ( found && any_hit )
+            return true;
+    }
+#endif
+
+    // the spheres left over
+    for ( ; i < end; i++ ) {
+        Vector3 o( r.e.x - center_x[i], r.e.y - center_y[i], r.e.z - center_z[i] );
+        real_t B = dot( r.d, o );
+        real_t C = dot( o, o ) - radius2[i];
+        real_t discriminant = B*B - A*C;
+        if ( discriminant < 0 )
+            continue;
+
+        real_t root = sqrt( discriminant );
+        real_t t1 = ( -B - root )/A;
+        real_t t2 = ( -B + root )/A;
+        if ( t1 > t1_min && t1 < t_max )
+            t_max = t = t1;
+        else if ( t2 > t2_min && t2 < t_max )
+            t_max = t = t2;
+        else
+            continue;
+        hit = i;
+        found = true;
+        if ( any_hit )
+            return true;
+    }
+    return found;
+}
+
+// same as Sphere::checkIntersection
+inline bool SceneBVH::intersect_ellipsoid( unsigned int i, const Ray& r, real_t offset, real_t t_max, real_t& t ) const
+{
+    Vector3 e = ellipsoids.inv_mat[i].transform_point( r.e );
+    Vector3 d = ellipsoids.inv_mat[i].transform_vector( r.d );
+
+    real_t A = dot( d, d );
+    real_t B = dot( d, e );
+    real_t C = dot( e, e ) - ellipsoids.radius2[i];
+    real_t discriminant = B*B - A*C;
+    if ( discriminant < 0 )
+        return false;
+
+    real_t root = sqrt( discriminant );
+    real_t t1 = ( -B - root )/A;
+    if ( t1 > SPHERE_EPSILON + offset && t1 < t_max ) {
+        t = t1;
+        return true;
+    }
+    real_t t2 = ( -B + root )/A;
+    if ( t2 > SPHERE_FAR_EPSILON + offset && t2 < t_max ) {
+        t = t2;
+        return true;
+    }
+    return false;
+}
+
+// Moller-Trumbore, with beta and gamma the weights of p1 and p2 and the
+// offsets of Triangle::checkIntersection and Model::checkIntersection
+inline bool SceneBVH::intersect_triangle( unsigned int i, const Ray& r, real_t offset, real_t t_max, Solution_info& s ) const
+{
+    const Vector3& edge1 = triangles.edge1[i];
+    const Vector3& edge2 = triangles.edge2[i];
+
+    Vector3 p = cross( r.d, edge2 );
+    real_t det = dot( edge1, p );
+    if ( det == 0 )
+        return false;
+    real_t inv_det = 1/det;
+
+    Vector3 q = r.e - triangles.p0[i];
+    real_t beta = dot( q, p )*inv_det;
+    Vector3 u = cross( q, edge1 );
+    real_t gamma = dot( r.d, u )*inv_det;
+    real_t t = dot( edge2, u )*inv_det;
+
+    real_t t_min = ( triangles.index[i] < 0 ? TRIANGLE_EPSILON : MODEL_EPSILON ) + offset;
+    if ( t < t_min || t >= t_max )
+        return false;
+    if ( gamma < 0.0 || gamma > 1.0 )
+        return false;
+    if ( beta < 0.0 || beta > 1.0 - gamma )
+        return false;
+
+    s.t = t;
+    s.beta = beta;
+    s.gamma = gamma;
+    s.index = triangles.index[i];
+    return true;
+}
+
+template<bool any_hit>
+bool SceneBVH::traverse( const Ray& r, real_t t_max, Solution_info& s, int& geometry_index ) const
+{
+    s.t = t_max;
+    if ( root < 0 )
+        return false;
+
+    Vector3 inv_d( 1/r.d.x, 1/r.d.y, 1/r.d.z );
+    real_t offset = hit_offset( r );
+    bool hit = false;
+
+    int stack[BVH_STACK_SIZE];
+    size_t top = 0;
+    stack[top++] = root;
+    while ( top > 0 ) {
+        const Node& node = nodes[stack[--top]];
+        if ( !hit_box( node.min, node.max, r.e, inv_d, s.t ) )
+            continue;
+
+        if ( node.left >= 0 ) {
+            // visit the child nearer along the split axis first
+            if ( r.d[node.axis] < 0 ) {
+                stack[top++] = node.left;
+                stack[top++] = node.right;
+            } else {
+                stack[top++] = node.right;
+                stack[top++] = node.left;
+            }
+            continue;
+        }
+
+        unsigned int end = node.first + node.count;
+        switch ( node.type ) {
+        case PRIMITIVE_SPHERE: {
+            real_t t;
+            unsigned int i;
+            if ( intersect_spheres( node.first, end, r, offset, s.t, any_hit, t, i ) ) {
+                s.t = t;
+                s.index = -1;
+                geometry_index = spheres.geometry[i];
+                hit = true;
+                if ( any_hit )
+                    return true;
+            }
+            break;
+        }
+
+        case PRIMITIVE_ELLIPSOID:
+            for ( unsigned int i = node.first; i < end; i++ ) {
+                real_t t;
+                if ( intersect_ellipsoid( i, r, offset, s.t, t ) ) {
+                    s.t = t;
+                    s.index = -1;
+                    geometry_index = ellipsoids.geometry[i];
+                    hit = true;
+                    if ( any_hit )
+                        return true;
+                }
+            }
+            break;
+
+        case PRIMITIVE_TRIANGLE:
+            for ( unsigned int i = node.first; i < end; i++ ) {
+                if ( intersect_triangle( i, r, offset, s.t, s ) ) {
+                    geometry_index = triangles.geometry[i];
+                    hit = true;
+                    if ( any_hit )
+                        return true;
+                }
+            }
+            break;
+
+        default:
+            for ( unsigned int i = node.first; i < end; i++ ) {
+                Solution_info other;
+                if ( geometries[others[i]]->checkIntersection( r, other, s.t ) && other.t < s.t ) {
+                    s = other;
+                    geometry_index = others[i];
+                    hit = true;
+                    if ( any_hit )
+                        return true;
+                }
+            }
+            break;
+        }
+    }
+    return hit;
+}
+
+bool SceneBVH::intersect( const Ray& r, real_t t_max, Solution_info& s, int& geometry_index ) const
+{
+    return traverse<false>( r, t_max, s, geometry_index );
+}
+
+bool SceneBVH::occluded( const Ray& r, real_t t_max ) const
+{
+    Solution_info s;
+    int geometry_index;
+    return traverse<true>( r, t_max, s, geometry_index );
+}
+
+} /* _462 */
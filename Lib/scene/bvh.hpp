@@ -0,0 +1,126 @@
+/**
+ * @file bvh.hpp
+ * @brief Bounding volume hierarchy over the geometries of a scene.
+ */
+
+#ifndef _462_SCENE_BVH_HPP_
+#define _462_SCENE_BVH_HPP_
+
+#include "scene/scene.hpp"
+#include <vector>
+
+namespace _462 {
+
+// most primitives in a leaf
+#define BVH_LEAF_SIZE 4
+// sphere leaves are tested several at a time, so they hold more
+#define BVH_SPHERE_LEAF_SIZE 8
+#define BVH_STACK_SIZE 64
+
+/**
+ * Bounding volume hierarchy for closest hit and shadow queries.
+ *
+ * Primitives are not reached through Geometry pointers. Spheres, and the
+ * triangles of Triangle and Model geometries, are copied by type into
+ * contiguous arrays, and every leaf covers a range of one of them. Triangles
+ * and uniformly scaled spheres are stored in world space. Affine
+ * transformations keep t and the barycentric coordinates, so a hit is the
+ * same Solution_info that checkIntersection would give. Traversal switches
+ * on the type of a leaf, so each intersection test is inlined into its
+ * loop, and sphere leaves are tested with SIMD across spheres. Geometries
+ * of any other type fall back to checkIntersection.
+ *
+ * The scene must be initialized before build, and must not change while
+ * the hierarchy is in use.
+ */
+class SceneBVH
+{
+public:
+
+    SceneBVH();
+
+    void build( Geometry* const* geometries, size_t num_geometries );
+
+    /// the closest hit before t_max, and the index of the geometry hit
+    bool intersect( const Ray& r, real_t t_max, Solution_info& s, int& geometry_index ) const;
+    /// whether anything is hit before t_max
+    bool occluded( const Ray& r, real_t t_max ) const;
+
+private:
+
+    enum PrimitiveType {
+        PRIMITIVE_SPHERE,
+        PRIMITIVE_ELLIPSOID,
+        PRIMITIVE_TRIANGLE,
+        PRIMITIVE_GEOMETRY,
+        NUM_PRIMITIVE_TYPES
+    };
+
+    struct Node
+    {
+        Vector3 min, max;
+        // children, or for a leaf (left < 0) count primitives of type
+        // starting at first
+        int left, right;
+        // the axis the children were split along
+        int axis;
+        PrimitiveType type;
+        unsigned int first, count;
+    };
+
+    struct Reference
+    {
+        Vector3 min, max, center;
+        unsigned int index;
+    };
+
+    // uniformly scaled spheres in world space, one array per component
+    struct SphereArray
+    {
+        std::vector<real_t> center_x, center_y, center_z;
+        std::vector<real_t> radius2;
+        std::vector<int> geometry;
+    };
+
+    // other spheres, intersected in their local space
+    struct EllipsoidArray
+    {
+        std::vector<Matrix4> inv_mat;
+        std::vector<real_t> radius2;
+        std::vector<int> geometry;
+    };
+
+    // world space triangles as vertex p0 and edges p1 - p0, p2 - p0. index
+    // is the face of a Model, or -1 for a Triangle.
+    struct TriangleArray
+    {
+        std::vector<Vector3> p0, edge1, edge2;
+        std::vector<int> geometry;
+        std::vector<int> index;
+    };
+
+    static void add_triangle( TriangleArray& list, std::vector<Reference>& refs,
+                              const Vector3 p[3], int geometry, int index );
+    int build_node( PrimitiveType type, std::vector<Reference>& refs, size_t begin, size_t end );
+
+    // offset is hit_offset( r )
+    bool intersect_spheres( unsigned int first, unsigned int end, const Ray& r, real_t offset,
+                            real_t t_max, bool any_hit, real_t& t, unsigned int& hit ) const;
+    bool intersect_ellipsoid( unsigned int i, const Ray& r, real_t offset, real_t t_max, real_t& t ) const;
+    bool intersect_triangle( unsigned int i, const Ray& r, real_t offset, real_t t_max, Solution_info& s ) const;
+    template<bool any_hit>
+    bool traverse( const Ray& r, real_t t_max, Solution_info& s, int& geometry_index ) const;
+
+    std::vector<Node> nodes;
+    int root;
+    SphereArray spheres;
+    EllipsoidArray ellipsoids;
+    TriangleArray triangles;
+    // indices of the geometries without an inlined test
+    std::vector<int> others;
+    Geometry* const* geometries;
+};
+
+} /* _462 */
+
+#endif /* _462_SCENE_BVH_HPP_ */
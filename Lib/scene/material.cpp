@@ -6,7 +6,10 @@
  */
 
 #include "scene/material.hpp"
-#include "application/imageio.hpp"
+#include "scene/scene.hpp"
+
+#include <algorithm>
+#include <cstdio>
 
 namespace _462 {
 
@@ -16,63 +19,85 @@ Material::Material():
     specular( Color3::Black() ),
     shininess( 10.0 ),
     refractive_index( 0.0 ),
-    tex_width( 0 ),
-    tex_height( 0 ),
-    tex_data( 0 )
+    texture( 0 )
 {
     tex_handle = 0;
 }
 
 Material::~Material()
 {
-    if ( tex_data ) {
-        free( tex_data );
-        if ( tex_handle ) {
-            glDeleteTextures( 1, &tex_handle );
-        }
+    if ( tex_handle ) {
+        glDeleteTextures( 1, &tex_handle );
+    }
+    if ( texture ) {
+        TextureCache::global().release( texture );
     }
 }
 
 bool Material::load()
 {
-    // if data has already been loaded, clear old data
-    if ( tex_data ) {
-        free( tex_data );
-        tex_data = 0;
+    // if a texture has already been looked up, drop it
+    if ( texture ) {
+        TextureCache::global().release( texture );
+        texture = 0;
     }
 
     // if no texture, nothing to do
     if ( texture_filename.empty() )
         return true;
 
-    std::cout << "Loading texture " << texture_filename << "...\n";
-
-    // allocates data with malloc
-    tex_data = imageio_load_image( texture_filename.c_str(), &tex_width, &tex_height );
-    if ( !tex_data ) {
+    // only check that the file is there, it is decoded on first use
+    FILE* file = fopen( texture_filename.c_str(), "rb" );
+    if ( !file ) {
         std::cerr << "Cannot load texture file " << texture_filename << std::endl;
         return false;
     }
+    fclose( file );
 
-    std::cout << "Finished loading texture" << std::endl;
+    texture = TextureCache::global().acquire( texture_filename );
     return true;
 }
 
-const unsigned char* Material::get_texture_data() const
+bool Material::get_texture_data( std::vector<unsigned char>* data ) const
 {
-    return tex_data;
+    return texture && texture->get_data( data );
 }
 
 void Material::get_texture_size( int* width, int* height ) const
 {
     assert( width && height );
-    *width = tex_width;
-    *height = tex_height;
+    if ( texture ) {
+        texture->get_level_size( 0, width, height );
+    } else {
+        *width = 0;
+        *height = 0;
+    }
 }
 
 Color3 Material::get_texture_pixel( int x, int y ) const
 {
-    return tex_data ? Color3( tex_data + 4 * (x + y * tex_width) ) : Color3::White();
+    return texture && texture->is_valid() ? texture->get_pixel( 0, x, y ) : Color3::White();
+}
+
+// smoothed bilinear interpolation of the texels of one level, wrapping
+// around the edges
+Color3 Material::bilinear_lookup( size_t level, Vector2 texCoord ) const
+{
+    int width, height;
+    texture->get_level_size( level, &width, &height );
+
+    real_t x = texCoord.x * width;
+    real_t y = texCoord.y * height;
+    int i = (int) floor( x );
+    int j = (int) floor( y );
+    real_t u = x - i;
+    real_t v = y - j;
+    u = 3*u*u - 2*u*u*u;
+    v = 3*v*v - 2*v*v*v;
+
+    i = ( i % width + width ) % width;
+    j = ( j % height + height ) % height;
+    return texture->bilinear( level, i, j, u, v );
 }
 
 bool Material::create_gl_data()
@@ -81,7 +106,9 @@ bool Material::create_gl_data()
     if ( texture_filename.empty() )
         return true;
 
-    if ( !tex_data ) {
+    // decodes the texture now, OpenGL needs all of it
+    std::vector<unsigned char> tex_data;
+    if ( !get_texture_data( &tex_data ) ) {
         return false;
     }
 
@@ -90,6 +117,8 @@ bool Material::create_gl_data()
         glDeleteTextures( 1, &tex_handle );
     }
 
+    int tex_width, tex_height;
+    get_texture_size( &tex_width, &tex_height );
     assert( tex_width > 0 && tex_height > 0 );
 
     glGenTextures( 1, &tex_handle );
@@ -98,7 +127,7 @@ bool Material::create_gl_data()
     }
 
     glBindTexture( GL_TEXTURE_2D, tex_handle );
-    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, tex_width, tex_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, tex_data );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, tex_width, tex_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &tex_data[0] );
 
     glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
     glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
@@ -135,19 +164,8 @@ void Material::reset_gl_state() const
 
 Color3 Material::texture_lookup(Vector2 texCoord) const
 {
-    if (tex_data && tex_width && tex_height) { 
-        int i = floor(texCoord.x*tex_width); 
-        int j = floor(texCoord.y*tex_height);
-        float u = texCoord.x*tex_width - i; 
-        float v = texCoord.y*tex_height - j;
-        u = 3*u*u - 2*u*u*u; 
-        v = 3*v*v - 2*v*v*v;
-        Color3 c1 = (1-u)*(1-v)*get_texture_pixel(i%tex_width, j%tex_height); 
-        Color3 c2 = u*(1-v)*get_texture_pixel((i+1)%tex_width, j%tex_height); 
-        Color3 c3 = (1-u)*v*get_texture_pixel(i%tex_width, (j+1)%tex_height); 
-        Color3 c4 = u*v*get_texture_pixel((i+1)%tex_width, (j+1)%tex_height);
-        Color3 tex_color = c1 + c2 + c3 + c4; 
-        return tex_color; 
+    if (texture && texture->is_valid()) { 
+        return bilinear_lookup(0, texCoord);
     } 
 
     Color3 white(1.0, 1.0, 1.0); 
@@ -155,4 +173,44 @@ Color3 Material::texture_lookup(Vector2 texCoord) const
 
 }
 
+Color3 Material::texture_lookup(Vector2 texCoord, Vector2 dtdx, Vector2 dtdy) const
+{
+    if (!texture || !texture->is_valid()) {
+        return Color3(1.0, 1.0, 1.0);
+    }
+    int tex_width, tex_height;
+    texture->get_level_size(0, &tex_width, &tex_height);
+
+    // footprint size in level 0 texels, along the longer axis
+    real_t fx = length(Vector2(dtdx.x*tex_width, dtdx.y*tex_height));
+    real_t fy = length(Vector2(dtdy.x*tex_width, dtdy.y*tex_height));
+    real_t footprint = std::max(fx, fy);
+    if (footprint <= 1) {
+        return bilinear_lookup(0, texCoord);
+    }
+
+    size_t last = texture->num_levels() - 1;
+    real_t lod = std::min(real_t(log(footprint)/log(2.0)), real_t(last));
+    size_t level = (size_t)lod;
+    real_t f = lod - level;
+    if (level >= last) {
+        return bilinear_lookup(last, texCoord);
+    }
+    return (1-f)*bilinear_lookup(level, texCoord) + f*bilinear_lookup(level + 1, texCoord);
+}
+
+bool Material::is_specular() const
+{
+    return refractive_index != 0 || specular != Color3::Black();
+}
+
+unsigned long long Material::hash( unsigned long long seed ) const
+{
+    seed = hash_bytes( &ambient, sizeof ambient, seed );
+    seed = hash_bytes( &diffuse, sizeof diffuse, seed );
+    seed = hash_bytes( &specular, sizeof specular, seed );
+    seed = hash_bytes( &refractive_index, sizeof refractive_index, seed );
+    return hash_bytes( texture_filename.c_str(), texture_filename.size(), seed );
+}
+
 }
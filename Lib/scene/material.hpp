@@ -11,7 +11,9 @@
 #include "math/color.hpp"
 #include "math/vector.hpp"
 #include "application/opengl.hpp"
+#include "scene/texture_cache.hpp"
 #include <string>
+#include <vector>
 
 namespace _462 {
 
@@ -43,14 +45,14 @@ public:
     std::string texture_filename;
 
     /**
-     * Loads the texture from a file and optionally create a gl texture handle
-     * for it. DO NOT CALL EVERY FRAME, as it will re-load the texture each time.
-     * @return true on success, false on error.
+     * Looks up the texture in the shared TextureCache, which decodes it on
+     * first use. DO NOT CALL EVERY FRAME.
+     * @return true on success, false if the file cannot be opened.
      */
     bool load();
 
-    /// returns the raw texture data
-    const unsigned char* get_texture_data() const;
+    /// copies the raw texture data, false if there is none
+    bool get_texture_data( std::vector<unsigned char>* data ) const;
 
     /// puts the dimensions into width and height
     void get_texture_size( int* width, int* height ) const;
@@ -74,13 +76,25 @@ public:
 
     Color3 texture_lookup(Vector2 textCoord)const;
 
+    /**
+     * The texture filtered over a footprint, given by the derivatives of
+     * texCoord with respect to the image x and y. Interpolates between the
+     * two mip levels whose texels are closest to the footprint size.
+     */
+    Color3 texture_lookup(Vector2 texCoord, Vector2 dtdx, Vector2 dtdy) const;
+
+    /// true if the material is a mirror or a dielectric
+    bool is_specular() const;
+
+    /// hashes the colors, refractive index and texture filename
+    unsigned long long hash( unsigned long long seed ) const;
+
 private:
 
-    // dimensions of the texture
-    int tex_width, tex_height;
+    // the texture and its mip levels, shared with other materials
+    CachedTexture* texture;
 
-    // raw texture data
-    unsigned char* tex_data;
+    Color3 bilinear_lookup( size_t level, Vector2 texCoord ) const;
 
     // opengl descriptor of the texture
     GLuint tex_handle;
@@ -10,6 +10,7 @@
 #include "scene/material.hpp"
 #include "application/opengl.hpp"
 #include "scene/triangle.hpp"
+#include "math/matrix_batch.hpp"
 #include <iostream>
 #include <cstring>
 #include <string>
@@ -33,7 +34,7 @@ void Model::render() const
         material->reset_gl_state();
 }
 
-bool Model::checkIntersection(Ray r, Solution_info &s, const real_t &t_max) {
+bool Model::checkIntersection(const Ray& r, Solution_info &s, const real_t &t_max) {
 
 
     face_list = this->mesh->get_triangles();
@@ -44,6 +45,7 @@ bool Model::checkIntersection(Ray r, Solution_info &s, const real_t &t_max) {
     Vector3 d_local = invMat.transform_vector(r.d);
 
     real_t t_min = t_max;
+    real_t epsilon = MODEL_EPSILON + hit_offset(r);
     real_t beta = -1;
     real_t gamma = -1;
     int index = 0;
@@ -80,7 +82,7 @@ bool Model::checkIntersection(Ray r, Solution_info &s, const real_t &t_max) {
 
         v_solution = minv*v_right;
 
-        if (v_solution.z<0.0001 || v_solution.z > t_max){
+        if (v_solution.z<epsilon || v_solution.z > t_max){
             continue;
         }
         if (v_solution.y<0.0 || v_solution.y>1.0) {
@@ -115,32 +117,104 @@ bool Model::checkIntersection(Ray r, Solution_info &s, const real_t &t_max) {
 }
 
 
-Material_Para Model::getMaterial(Ray r, Solution_info s) {
+Material_Para Model::getMaterial(const Ray& r, const Solution_info& s, unsigned int fields) {
 
     real_t alpha = 1.0-s.beta-s.gamma;
 
-    
-    MeshVertex PointA = vertices_list[face_list[s.index].vertices[0]];
-    MeshVertex PointB = vertices_list[face_list[s.index].vertices[1]];
-    MeshVertex PointC = vertices_list[face_list[s.index].vertices[2]];
-    
+    Material_Para returnPara;
+    if (fields & MATERIAL_COLORS) {
+        returnPara.ambient = this->material->ambient;
+        returnPara.diffuse = this->material->diffuse;    
+        returnPara.specular = this->material->specular;
+        returnPara.refractive_index = this->material->refractive_index;
+    }
+    bool texture = (fields & MATERIAL_TEXTURE) != 0;
+    if (!(fields & MATERIAL_NORMAL) && !texture) {
+        return returnPara;
+    }
+
+    // from the mesh, as the hit may not come from checkIntersection
+    const MeshTriangle& face = this->mesh->get_triangles()[s.index];
+    const MeshVertex* vertices = this->mesh->get_vertices();
+    const MeshVertex& PointA = vertices[face.vertices[0]];
+    const MeshVertex& PointB = vertices[face.vertices[1]];
+    const MeshVertex& PointC = vertices[face.vertices[2]];
+
+    if ((fields & MATERIAL_NORMAL) || (texture && r.has_differentials)) {
+        Vector3 local_normal = PointA.normal*alpha + PointB.normal*s.beta + PointC.normal*s.gamma;
+        returnPara.normal = normalize(this->normMat*local_normal);  
+    }
+    if (!texture) {
+        return returnPara;
+    }
+
     // interpolate the texature 2D coord
     Vector2 tex_coord = PointA.tex_coord*alpha + PointB.tex_coord*s.beta + PointC.tex_coord*s.gamma;
-    Material_Para returnPara;
-    returnPara.ambient = this->material->ambient;
-    returnPara.diffuse = this->material->diffuse;    
-    returnPara.specular = this->material->specular;
-    returnPara.refractive_index = this->material->refractive_index;
+
+    // texture footprint from the ray differentials
+    Vector2 dtdx(0, 0), dtdy(0, 0);
+    if (r.has_differentials) {
+        Vector3 dpdx, dpdy;
+        r.hit_differentials(s.t, returnPara.normal, dpdx, dpdy);
+        Vector3 p[3] = { PointA.position, PointB.position, PointC.position };
+        Vector2 t[3] = { PointA.tex_coord, PointB.tex_coord, PointC.tex_coord };
+        dtdx = texture_coord_delta(p, t, invMat.transform_vector(dpdx));
+        dtdy = texture_coord_delta(p, t, invMat.transform_vector(dpdy));
+    }
 
     // texture
-    returnPara.texture = this->material->texture_lookup(tex_coord);
-    Vector3 local_normal = PointA.normal*alpha + PointB.normal*s.beta + PointC.normal*s.gamma;
-    returnPara.normal = normalize(this->normMat*local_normal);  
+    returnPara.texture = this->material->texture_lookup(tex_coord, dtdx, dtdy);
 
     return returnPara;  
 }
 
 
+unsigned long long Model::hash( unsigned long long seed ) const
+{
+    seed = Geometry::hash( seed );
+    if ( material )
+        seed = material->hash( seed );
+    if ( mesh ) {
+        if ( mesh->num_vertices() )
+            seed = hash_bytes( mesh->get_vertices(),
+                               mesh->num_vertices() * sizeof( MeshVertex ), seed );
+        if ( mesh->num_triangles() )
+            seed = hash_bytes( mesh->get_triangles(),
+                               mesh->num_triangles() * sizeof( MeshTriangle ), seed );
+    }
+    return seed;
+}
+
+void Model::get_bounds( Vector3* min, Vector3* max ) const
+{
+    if ( !mesh || !mesh->num_vertices() ) {
+        *min = *max = position;
+        return;
+    }
+
+    const MeshVertex* vertices = mesh->get_vertices();
+    size_t num_vertices = mesh->num_vertices();
+    std::vector<real_t> x( num_vertices ), y( num_vertices ), z( num_vertices );
+    for ( size_t i = 0; i < num_vertices; ++i ) {
+        x[i] = vertices[i].position.x;
+        y[i] = vertices[i].position.y;
+        z[i] = vertices[i].position.z;
+    }
+    transform_points_n( mat, &x[0], &y[0], &z[0], &x[0], &y[0], &z[0], num_vertices );
+
+    *min = *max = Vector3( x[0], y[0], z[0] );
+    for ( size_t i = 1; i < num_vertices; ++i ) {
+        Vector3 p( x[i], y[i], z[i] );
+        *min = vmin( *min, p );
+        *max = vmax( *max, p );
+    }
+}
+
+bool Model::has_specular() const
+{
+    return material && material->is_specular();
+}
+
 void Model::printname() {
 
     printf("this is model\n");
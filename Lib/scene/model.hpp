@@ -31,9 +31,13 @@ public:
 
     virtual void render() const;
     
-    virtual bool checkIntersection(Ray r, Solution_info &s, const real_t &t_max);
-    virtual Material_Para getMaterial(Ray r, Solution_info s);
+    virtual bool checkIntersection(const Ray& r, Solution_info &s, const real_t &t_max);
+    virtual Material_Para getMaterial(const Ray& r, const Solution_info& s,
+                                      unsigned int fields = MATERIAL_ALL);
     virtual void printname();
+    virtual void get_bounds( Vector3* min, Vector3* max ) const;
+    virtual bool has_specular() const;
+    virtual unsigned long long hash( unsigned long long seed ) const;
 
 };
 
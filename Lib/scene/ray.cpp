@@ -11,12 +11,14 @@ Vector3 cU;
 real_t dist;
 Vector3 pos;
 
-Ray::Ray(){}
+Ray::Ray()
+    : has_differentials(false) {}
 
 Ray::Ray(Vector3 e, Vector3 d)
 {
     this->e = e;
     this->d = d;
+    has_differentials = false;
 }
 
 void Ray::init(const Camera& camera)
@@ -35,4 +37,52 @@ Vector3 Ray::get_pixel_dir(real_t ni, real_t nj)
     return normalize(dir + dist*(nj*cU + AR*ni*cR));
 }
 
+void Ray::set_pixel_differentials(real_t x, real_t y, real_t dx, real_t dy)
+{
+    has_differentials = true;
+    dedx = Vector3(0, 0, 0);
+    dedy = Vector3(0, 0, 0);
+    dddx = get_pixel_dir(x + dx, y) - d;
+    dddy = get_pixel_dir(x, y + dy) - d;
+}
+
+// Igehy's transfer: the offset rays travel to the tangent plane at the hit
+void Ray::hit_differentials(real_t t, const Vector3& normal, Vector3& dpdx, Vector3& dpdy) const
+{
+    dpdx = dedx + t*dddx;
+    dpdy = dedy + t*dddy;
+    real_t dn = dot(d, normal);
+    if (dn != 0) {
+        dpdx -= d*(dot(dpdx, normal)/dn);
+        dpdy -= d*(dot(dpdy, normal)/dn);
+    }
+}
+
+void Ray::reflect_differentials(const Ray& incident, real_t t, const Vector3& normal)
+{
+    has_differentials = incident.has_differentials;
+    if (!has_differentials) {
+        return;
+    }
+    incident.hit_differentials(t, normal, dedx, dedy);
+    dddx = incident.dddx - 2*dot(incident.dddx, normal)*normal;
+    dddy = incident.dddy - 2*dot(incident.dddy, normal)*normal;
+}
+
+void Ray::refract_differentials(const Ray& incident, real_t t, const Vector3& normal, real_t eta)
+{
+    has_differentials = incident.has_differentials;
+    if (!has_differentials) {
+        return;
+    }
+    incident.hit_differentials(t, normal, dedx, dedy);
+
+    // d = eta*incident.d - mu*n with n facing the incident ray
+    Vector3 n = dot(incident.d, normal) < 0 ? normal : -normal;
+    real_t dn = dot(incident.d, n);
+    real_t dmu = eta - eta*eta*dn/dot(d, n);
+    dddx = eta*incident.dddx - (dmu*dot(incident.dddx, n))*n;
+    dddy = eta*incident.dddy - (dmu*dot(incident.dddy, n))*n;
+}
+
 }
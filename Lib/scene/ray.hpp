@@ -18,11 +18,28 @@ class Ray
 public:
     Vector3 e;
     Vector3 d;
+    // derivatives of e and d with respect to the image x and y, for
+    // filtering textures. Only valid if has_differentials.
+    bool has_differentials;
+    Vector3 dedx, dedy;
+    Vector3 dddx, dddy;
+
     Ray();
     Ray(Vector3 e, Vector3 d);
 
     static Vector3 get_pixel_dir(real_t x, real_t y);
 	static void init(const Camera& camera);
+
+    // differentials of the camera ray through (x, y), with neighbouring
+    // pixels dx and dy away
+    void set_pixel_differentials(real_t x, real_t y, real_t dx, real_t dy);
+    // derivatives of the point e + t*d on a surface with the given normal
+    void hit_differentials(real_t t, const Vector3& normal, Vector3& dpdx, Vector3& dpdy) const;
+    // differentials of this ray, already set up as the reflection or
+    // refraction of incident at e + t*d. The curvature of the surface is
+    // ignored. eta is the ratio of the refractive indices n1/n2.
+    void reflect_differentials(const Ray& incident, real_t t, const Vector3& normal);
+    void refract_differentials(const Ray& incident, real_t t, const Vector3& normal, real_t eta);
 };
 
 }
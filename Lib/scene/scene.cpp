@@ -24,13 +24,37 @@ Geometry::~Geometry() { }
 bool Geometry::initialize()
 {
 	make_inverse_transformation_matrix(&invMat, position, orientation, scale);
-	Matrix4 mat;
 	make_transformation_matrix(&mat, position, orientation, scale);
 	make_normal_matrix(&normMat, mat);
 
 	return true;
 }
 
+unsigned long long Geometry::hash( unsigned long long seed ) const
+{
+    seed = hash_bytes( &position, sizeof position, seed );
+    seed = hash_bytes( &orientation, sizeof orientation, seed );
+    return hash_bytes( &scale, sizeof scale, seed );
+}
+
+Vector2 texture_coord_delta( const Vector3 p[3], const Vector2 tex_coord[3], const Vector3& dp )
+{
+    // least squares solution of dp = e1 * beta + e2 * gamma
+    Vector3 e1 = p[1] - p[0];
+    Vector3 e2 = p[2] - p[0];
+    real_t a11 = dot( e1, e1 );
+    real_t a12 = dot( e1, e2 );
+    real_t a22 = dot( e2, e2 );
+    real_t det = a11 * a22 - a12 * a12;
+    if ( det == 0 )
+        return Vector2( 0, 0 );
+    real_t b1 = dot( e1, dp );
+    real_t b2 = dot( e2, dp );
+    real_t beta = ( a22 * b1 - a12 * b2 ) / det;
+    real_t gamma = ( a11 * b2 - a12 * b1 ) / det;
+    return ( tex_coord[1] - tex_coord[0] ) * beta + ( tex_coord[2] - tex_coord[0] ) * gamma;
+}
+
 SphereLight::SphereLight():
     position(Vector3::Zero()),
     color(Color3::White()),
@@ -41,6 +65,24 @@ SphereLight::SphereLight():
     attenuation.quadratic = 0;
 }
 
+bool SphereLight::intersect( const Ray& r, real_t& t ) const
+{
+    Vector3 oc = r.e - position;
+    real_t a = squared_length( r.d );
+    real_t b = dot( r.d, oc );
+    real_t c = squared_length( oc ) - radius * radius;
+    real_t discriminant = b * b - a * c;
+    if ( a == 0 || discriminant < 0 )
+        return false;
+
+    // the nearest intersection in front of the origin
+    real_t root = sqrt( discriminant );
+    t = ( -b - root ) / a;
+    if ( t <= 0 )
+        t = ( -b + root ) / a;
+    return t > 0;
+}
+
 Scene::Scene()
 {
     reset();
@@ -59,6 +101,20 @@ bool Scene::initialize()
 	return res;
 }
 
+unsigned long long Scene::hash() const
+{
+    unsigned long long seed = HASH_SEED;
+    for ( size_t i = 0; i < geometries.size(); i++ )
+        seed = geometries[i]->hash( seed );
+    for ( size_t i = 0; i < point_lights.size(); i++ ) {
+        const SphereLight& l = point_lights[i];
+        seed = hash_bytes( &l.position, sizeof l.position, seed );
+        seed = hash_bytes( &l.color, sizeof l.color, seed );
+        seed = hash_bytes( &l.attenuation, sizeof l.attenuation, seed );
+        seed = hash_bytes( &l.radius, sizeof l.radius, seed );
+    }
+    return hash_bytes( &refractive_index, sizeof refractive_index, seed );
+}
 
 Geometry* const* Scene::get_geometries() const
 {
@@ -21,6 +21,23 @@
 
 namespace _462 {
 
+/**
+ * FNV-1a hash of a block of memory, chained through seed. Used to key cached
+ * data (e.g. photon maps) on the contents of a scene.
+ */
+inline unsigned long long hash_bytes( const void* data, size_t size,
+                                      unsigned long long seed )
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>( data );
+    for ( size_t i = 0; i < size; ++i ) {
+        seed ^= bytes[i];
+        seed *= 1099511628211ULL;
+    }
+    return seed;
+}
+
+#define HASH_SEED 14695981039346656037ULL
+
 struct Material_Para {
     
     Color3 ambient;
@@ -32,6 +49,15 @@ struct Material_Para {
 
 };
 
+// the parts of Material_Para that getMaterial should fill in
+enum MaterialField {
+    // ambient, diffuse, specular and refractive_index
+    MATERIAL_COLORS = 1,
+    MATERIAL_NORMAL = 2,
+    MATERIAL_TEXTURE = 4,
+    MATERIAL_ALL = 7
+};
+
 struct Solution_info {
     real_t t;
     real_t beta;
@@ -39,6 +65,41 @@ struct Solution_info {
     int index;
 };
 
+/*
+ * Hits closer than these t are ignored, so that rays leaving a surface do
+ * not hit it again. Single precision needs larger offsets, and as its
+ * error grows with the coordinates, hit_offset adds a part relative to
+ * the ray origin.
+ */
+#ifdef REAL_FLOAT
+#define SPHERE_EPSILON 1e-4
+#define SPHERE_FAR_EPSILON 1e-4
+#define TRIANGLE_EPSILON 1e-4
+#define MODEL_EPSILON 1e-3
+#define RELATIVE_HIT_EPSILON 1e-5
+#else
+#define SPHERE_EPSILON 0.000001
+#define SPHERE_FAR_EPSILON 0.00001
+#define TRIANGLE_EPSILON 0.000001
+#define MODEL_EPSILON 0.0001
+#endif
+
+// added to the epsilons above for hits of r
+inline real_t hit_offset( const Ray& r )
+{
+#ifdef RELATIVE_HIT_EPSILON
+    real_t m = std::max( fabs( r.e.x ), std::max( fabs( r.e.y ), fabs( r.e.z ) ) );
+    return real_t( RELATIVE_HIT_EPSILON )*m/length( r.d );
+#else
+    (void) r;
+    return 0;
+#endif
+}
+
+// change of the interpolated texture coordinate of triangle p for a step dp
+// in its plane
+Vector2 texture_coord_delta( const Vector3 p[3], const Vector2 tex_coord[3], const Vector3& dp );
+
 
 class Geometry
 {
@@ -63,6 +124,8 @@ public:
     // The world scale of the object.
     Vector3 scale;
 
+    // Transformation matrix
+	Matrix4 mat;
     // Inverse transformation matrix
 	Matrix4 invMat;
     // Normal transformation matrix
@@ -72,10 +135,31 @@ public:
      * Renders this geometry using OpenGL in the local coordinate space.
      */
     virtual void render() const = 0;
-    virtual bool checkIntersection(Ray r, Solution_info &s, const real_t &t_max) = 0;
-    virtual Material_Para getMaterial(Ray r, Solution_info s) = 0;
+    virtual bool checkIntersection(const Ray& r, Solution_info &s, const real_t &t_max) = 0;
+    // the material at hit s of r. Only the given MaterialFields are
+    // computed, the others are left undefined.
+    virtual Material_Para getMaterial(const Ray& r, const Solution_info& s,
+                                      unsigned int fields = MATERIAL_ALL) = 0;
     virtual void printname() = 0;
 
+    /**
+     * Computes an axis-aligned box around this geometry in world space.
+     * Only valid after initialize().
+     */
+    virtual void get_bounds( Vector3* min, Vector3* max ) const = 0;
+
+    /**
+     * Whether any part of this geometry reflects or refracts specularly,
+     * i.e. whether it can focus light into caustics.
+     */
+    virtual bool has_specular() const = 0;
+
+    /**
+     * Hashes everything about this geometry that affects light transport.
+     * The base version covers the transformation only.
+     */
+    virtual unsigned long long hash( unsigned long long seed ) const;
+
 	bool initialize();
 
 };
@@ -92,7 +176,8 @@ struct SphereLight
 
     SphereLight();
 
-	bool intersect(const Ray& r, real_t& t);
+	// the first t > 0 at which r enters or leaves the sphere of the light
+	bool intersect(const Ray& r, real_t& t) const;
 
     // The position of the light, relative to world origin.
     Vector3 position;
@@ -128,6 +213,12 @@ public:
 
 	bool initialize();
 
+    /**
+     * Hash of the geometry, materials and lights, i.e. everything photon
+     * transport depends on. Camera and background are not included.
+     */
+    unsigned long long hash() const;
+
     // accessor functions
     Geometry* const* get_geometries() const;
     size_t num_geometries() const;
@@ -96,7 +96,7 @@ void Sphere::render() const
         material->reset_gl_state();
 }
 
-bool Sphere::checkIntersection(Ray r, Solution_info &s, const real_t &t_max) {
+bool Sphere::checkIntersection(const Ray& r, Solution_info &s, const real_t &t_max) {
 
   
     Vector3 e_local = invMat.transform_point(r.e);
@@ -105,7 +105,7 @@ bool Sphere::checkIntersection(Ray r, Solution_info &s, const real_t &t_max) {
 
     real_t A = dot(d_local, d_local);
     real_t B = dot(d_local, (e_local-c_local));
-    real_t B_square = pow(B, 2);
+    real_t B_square = B*B;
     real_t C = dot(e_local-c_local, e_local-c_local)-(this->radius*this->radius);
     
     real_t discriminant = B_square - A*C; 
@@ -120,15 +120,17 @@ bool Sphere::checkIntersection(Ray r, Solution_info &s, const real_t &t_max) {
         t1 = ( -B - temp ) / A;
         t2 = ( -B + temp ) / A;
   
+        real_t offset = hit_offset(r);
+
         //check whether the t1 is inside the range.        
-        if(t1>0.000001 && t1<t_max) {
+        if(t1>SPHERE_EPSILON+offset && t1<t_max) {
             
             s.t = t1;
             s.index = -1;
             return true;
 
         //check t2 too.
-        }else if (t2>0.00001 && t2<t_max) {
+        }else if (t2>SPHERE_FAR_EPSILON+offset && t2<t_max) {
             s.t = t2;
             s.index = -1;
             return true;
@@ -139,34 +141,95 @@ bool Sphere::checkIntersection(Ray r, Solution_info &s, const real_t &t_max) {
 
 }
 
-Material_Para Sphere::getMaterial(Ray r, Solution_info s) {
+// texture coordinate of the sphere point in direction normal
+static Vector2 sphere_tex_coord(const Vector3& normal, real_t radius)
+{
+    real_t theta = acos(normal.z/radius); 
+    real_t phi = atan2(normal.y, normal.x); 
+    Vector2 tex_coord; 
+    tex_coord.x = phi < 0 ? phi/2/PI + 1.0: phi/2/PI; 
+    tex_coord.y = 1.0 - theta/PI; 
+    return tex_coord;
+}
+
+// change of the texture coordinate from local point pt to the point of the
+// sphere in direction pt + dp
+Vector2 Sphere::tex_coord_delta(const Vector3& pt, const Vector2& tex_coord, const Vector3& dp) const
+{
+    Vector3 q = normalize(pt + dp)*length(pt);
+    Vector2 delta = sphere_tex_coord(this->normMat*q, radius) - tex_coord;
+    // the short way around the seam
+    if (delta.x > 0.5) {
+        delta.x -= 1;
+    } else if (delta.x < -0.5) {
+        delta.x += 1;
+    }
+    return delta;
+}
+
+Material_Para Sphere::getMaterial(const Ray& r, const Solution_info& s, unsigned int fields) {
 
-    Vector3 e_local = invMat.transform_point(r.e);
-    Vector3 d_local = invMat.transform_vector(r.d);
-    Vector3 pt = e_local + d_local*s.t;
-    
-    
     Material_Para returnPara;
-    returnPara.ambient = this->material->ambient;
-    returnPara.diffuse = this->material->diffuse;
-    returnPara.specular = this->material->specular;
-    returnPara.refractive_index = this->material->refractive_index;  
+    if (fields & MATERIAL_COLORS) {
+        returnPara.ambient = this->material->ambient;
+        returnPara.diffuse = this->material->diffuse;
+        returnPara.specular = this->material->specular;
+        returnPara.refractive_index = this->material->refractive_index;  
+    }
+    if (!(fields & (MATERIAL_NORMAL|MATERIAL_TEXTURE))) {
+        return returnPara;
+    }
 
+    // one transform of the hit point instead of the whole ray
+    Vector3 pt = invMat.transform_point(r.e + r.d*s.t);
     Vector3 normal = this->normMat * pt;
     returnPara.normal = normalize(normal);
+    if (!(fields & MATERIAL_TEXTURE)) {
+        return returnPara;
+    }
 
     // compute texture coordinate of sphere 
-    real_t theta = acos(normal.z/radius); 
-    real_t phi = atan2(normal.y, normal.x); 
-    Vector2 tex_coord; 
-    tex_coord.x = phi < 0 ? phi/2/PI + 1.0: phi/2/PI; 
-    tex_coord.y = 1.0 - theta/PI; 
-    returnPara.texture = this->material->texture_lookup(tex_coord);
+    Vector2 tex_coord = sphere_tex_coord(normal, radius);
+
+    // texture footprint from the ray differentials
+    Vector2 dtdx(0, 0), dtdy(0, 0);
+    if (r.has_differentials) {
+        Vector3 dpdx, dpdy;
+        r.hit_differentials(s.t, returnPara.normal, dpdx, dpdy);
+        dtdx = tex_coord_delta(pt, tex_coord, invMat.transform_vector(dpdx));
+        dtdy = tex_coord_delta(pt, tex_coord, invMat.transform_vector(dpdy));
+    }
+    returnPara.texture = this->material->texture_lookup(tex_coord, dtdx, dtdy);
 
     return returnPara;
         
 }
 
+unsigned long long Sphere::hash( unsigned long long seed ) const
+{
+    seed = Geometry::hash( seed );
+    seed = hash_bytes( &radius, sizeof radius, seed );
+    return material ? material->hash( seed ) : seed;
+}
+
+void Sphere::get_bounds( Vector3* min, Vector3* max ) const
+{
+    // transform the corners of the local box around the sphere
+    for ( int i = 0; i < 8; ++i ) {
+        Vector3 corner( ( i & 1 ) ? radius : -radius,
+                        ( i & 2 ) ? radius : -radius,
+                        ( i & 4 ) ? radius : -radius );
+        Vector3 p = mat.transform_point( corner );
+        *min = i == 0 ? p : vmin( *min, p );
+        *max = i == 0 ? p : vmax( *max, p );
+    }
+}
+
+bool Sphere::has_specular() const
+{
+    return material && material->is_specular();
+}
+
 void Sphere::printname() {
 
     printf("this is sphere\n");
@@ -26,9 +26,17 @@ public:
     Sphere();
     virtual ~Sphere();
     virtual void render() const;
-    virtual bool checkIntersection(Ray r, Solution_info &s, const real_t &t_max);
-    virtual Material_Para getMaterial(Ray r, Solution_info s);
+    virtual bool checkIntersection(const Ray& r, Solution_info &s, const real_t &t_max);
+    virtual Material_Para getMaterial(const Ray& r, const Solution_info& s,
+                                      unsigned int fields = MATERIAL_ALL);
     virtual void printname();
+    virtual void get_bounds( Vector3* min, Vector3* max ) const;
+    virtual bool has_specular() const;
+    virtual unsigned long long hash( unsigned long long seed ) const;
+
+private:
+
+    Vector2 tex_coord_delta(const Vector3& pt, const Vector2& tex_coord, const Vector3& dp) const;
 };
 
 } /* _462 */
@@ -0,0 +1,534 @@
+/**
+ * @file texture_cache.cpp
+ * @brief Shared, lazily loaded textures with a bounded tile cache.
+ */
+
+#include "scene/texture_cache.hpp"
+#include "application/imageio.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+namespace _462 {
+
+// retired tiles to collect before trying to free them
+#define TEXTURE_CACHE_RECLAIM_BATCH 64
+
+// a TextureTile in the clock ring of its shard
+struct CachedTexture::Tile : public TextureTile
+{
+    std::atomic<Tile*>* slot;
+    // set by lookups, cleared by the clock hand passing over it
+    std::atomic<bool> referenced;
+    size_t position;
+};
+
+struct TextureCache::Shard
+{
+    std::mutex lock;
+    std::vector<CachedTexture::Tile*> ring;
+    size_t hand;
+    size_t bytes;
+
+    Shard() : hand( 0 ), bytes( 0 ) {}
+
+    void insert( CachedTexture::Tile* tile )
+    {
+        tile->position = ring.size();
+        ring.push_back( tile );
+        bytes += sizeof *tile;
+    }
+
+    void remove( CachedTexture::Tile* tile )
+    {
+        CachedTexture::Tile* last = ring.back();
+        ring[tile->position] = last;
+        last->position = tile->position;
+        ring.pop_back();
+        bytes -= sizeof *tile;
+    }
+};
+
+/*
+ * Lookups read tiles without locks, so an evicted tile is only deleted
+ * when no lookup can still be reading it. Every thread announces the
+ * epoch it started its current lookup in, and 0 outside of lookups.
+ * Eviction clears the slot and then advances the epoch, so a lookup that
+ * announced a later epoch cannot find the tile any more. A tile retired
+ * in epoch e is freed once every announced epoch is past e.
+ */
+static std::atomic<unsigned long long> tile_epoch( 1 );
+
+struct ReaderEpoch
+{
+    std::atomic<unsigned long long> epoch;
+    std::atomic<bool> used;
+    // keep the announcements of different threads on different lines
+    char padding[64 - sizeof( std::atomic<unsigned long long> ) - sizeof( std::atomic<bool> )];
+};
+
+static std::mutex readers_lock;
+static std::vector<ReaderEpoch*> readers;
+
+// the announcement of this thread, given back when the thread ends
+struct ThreadReader
+{
+    ReaderEpoch* reader;
+
+    ThreadReader()
+    {
+        std::lock_guard<std::mutex> guard( readers_lock );
+        for ( size_t i = 0; i < readers.size(); i++ ) {
+            if ( !readers[i]->used.load( std::memory_order_relaxed ) ) {
+                reader = readers[i];
+                reader->used.store( true, std::memory_order_relaxed );
+                return;
+            }
+        }
+        reader = new ReaderEpoch();
+        reader->epoch.store( 0 );
+        reader->used.store( true );
+        readers.push_back( reader );
+    }
+
+    ~ThreadReader()
+    {
+        std::lock_guard<std::mutex> guard( readers_lock );
+        reader->epoch.store( 0 );
+        reader->used.store( false, std::memory_order_relaxed );
+    }
+};
+
+// announces the current epoch for the lifetime of a lookup
+class ReadGuard
+{
+public:
+
+    ReadGuard()
+    {
+        static thread_local ThreadReader thread_reader;
+        reader = thread_reader.reader;
+        reader->epoch.store( tile_epoch.load() );
+    }
+
+    ~ReadGuard()
+    {
+        reader->epoch.store( 0, std::memory_order_release );
+    }
+
+private:
+
+    ReaderEpoch* reader;
+};
+
+CachedTexture::CachedTexture( TextureCache* cache, const std::string& filename ):
+    cache( cache ),
+    filename( filename ),
+    references( 0 ),
+    loaded( false ),
+    valid( false ),
+    decoded( false ),
+    decoded_bytes( 0 ),
+    decoded_prev( 0 ),
+    decoded_next( 0 )
+{
+
+}
+
+CachedTexture::~CachedTexture()
+{
+    cache->remove_decoded( this );
+    cache->free_tiles( this );
+}
+
+// decodes the file on first use, to know whether it is valid and its size
+void CachedTexture::load()
+{
+    if ( loaded.load( std::memory_order_acquire ) )
+        return;
+
+    std::lock_guard<std::mutex> guard( data_lock );
+    if ( loaded.load( std::memory_order_relaxed ) )
+        return;
+
+    valid = decode();
+    loaded.store( true, std::memory_order_release );
+}
+
+// makes the RGBA8 pyramid resident, with data_lock held. Only the first
+// decode creates the levels; later ones refill their data.
+bool CachedTexture::decode()
+{
+    if ( decoded ) {
+        cache->touch_decoded( this );
+        return true;
+    }
+
+    bool first = levels.empty();
+    if ( first )
+        std::cout << "Loading texture " << filename << "...\n";
+
+    int width, height;
+    // allocates data with malloc
+    unsigned char* data = imageio_load_image( filename.c_str(), &width, &height );
+    if ( !data ) {
+        std::cerr << "Cannot load texture file " << filename << std::endl;
+        return false;
+    }
+
+    if ( first ) {
+        // the tile slots cannot be copied, so all levels are created at once
+        size_t num_levels = 1;
+        for ( int w = width, h = height; w > 1 || h > 1; num_levels++ ) {
+            w = std::max( w / 2, 1 );
+            h = std::max( h / 2, 1 );
+        }
+        levels = std::vector<Level>( num_levels );
+
+        for ( size_t i = 0; i < num_levels; i++ ) {
+            Level& level = levels[i];
+            level.width = i == 0 ? width : std::max( levels[i - 1].width / 2, 1 );
+            level.height = i == 0 ? height : std::max( levels[i - 1].height / 2, 1 );
+            level.tiles_x = texture_tile_count( level.width );
+            level.tiles = std::vector< std::atomic<Tile*> >( level.tiles_x * texture_tile_count( level.height ) );
+            for ( size_t j = 0; j < level.tiles.size(); j++ )
+                level.tiles[j].store( 0, std::memory_order_relaxed );
+        }
+    } else if ( width != levels[0].width || height != levels[0].height ) {
+        std::cerr << "Texture file " << filename << " changed size" << std::endl;
+        free( data );
+        return false;
+    }
+
+    levels[0].data.assign( data, data + 4 * width * height );
+    free( data );
+    size_t bytes = levels[0].data.size();
+
+    for ( size_t i = 1; i < levels.size(); i++ ) {
+        const Level& src = levels[i - 1];
+        Level& level = levels[i];
+        level.data.resize( 4 * level.width * level.height );
+        bytes += level.data.size();
+
+        // average 2x2 blocks, clamped at odd edges
+        for ( int y = 0; y < level.height; y++ ) {
+            int y0 = std::min( 2 * y, src.height - 1 );
+            int y1 = std::min( 2 * y + 1, src.height - 1 );
+            for ( int x = 0; x < level.width; x++ ) {
+                int x0 = std::min( 2 * x, src.width - 1 );
+                int x1 = std::min( 2 * x + 1, src.width - 1 );
+                for ( int c = 0; c < 4; c++ ) {
+                    int sum = src.data[4 * (x0 + y0 * src.width) + c]
+                            + src.data[4 * (x1 + y0 * src.width) + c]
+                            + src.data[4 * (x0 + y1 * src.width) + c]
+                            + src.data[4 * (x1 + y1 * src.width) + c];
+                    level.data[4 * (x + y * level.width) + c] = (unsigned char) ( ( sum + 2 ) / 4 );
+                }
+            }
+        }
+    }
+
+    cache->add_decoded( this, bytes );
+    if ( first )
+        std::cout << "Finished loading texture" << std::endl;
+    return true;
+}
+
+// frees the RGBA8 pyramid, with data_lock held. The sizes and tiles stay.
+void CachedTexture::drop_data()
+{
+    for ( size_t i = 0; i < levels.size(); i++ )
+        std::vector<unsigned char>().swap( levels[i].data );
+}
+
+bool CachedTexture::is_valid()
+{
+    load();
+    return valid;
+}
+
+size_t CachedTexture::num_levels()
+{
+    load();
+    return levels.size();
+}
+
+void CachedTexture::get_level_size( size_t level, int* width, int* height )
+{
+    load();
+    *width = valid ? levels[level].width : 0;
+    *height = valid ? levels[level].height : 0;
+}
+
+bool CachedTexture::get_data( std::vector<unsigned char>* data )
+{
+    load();
+    if ( !valid )
+        return false;
+    std::lock_guard<std::mutex> guard( data_lock );
+    if ( !decode() )
+        return false;
+    *data = levels[0].data;
+    return true;
+}
+
+Color3 CachedTexture::get_pixel( size_t level, int x, int y )
+{
+    return bilinear( level, x, y, 0, 0 );
+}
+
+Color3 CachedTexture::bilinear( size_t level, int x, int y, real_t u, real_t v )
+{
+    load();
+    return cache->lookup( *this, level, x, y, u, v );
+}
+
+TextureCache& TextureCache::global()
+{
+    static TextureCache cache;
+    return cache;
+}
+
+TextureCache::TextureCache():
+    decoded_head( 0 ),
+    decoded_tail( 0 ),
+    decoded_bytes( 0 )
+{
+    shards = new Shard[TEXTURE_CACHE_SHARDS];
+    set_memory_budget( TEXTURE_CACHE_BUDGET );
+}
+
+TextureCache::~TextureCache()
+{
+    for ( std::map<std::string, CachedTexture*>::iterator i = textures.begin();
+          i != textures.end(); ++i ) {
+        delete i->second;
+    }
+    // nothing looks up tiles any more
+    for ( size_t i = 0; i < retired.size(); i++ )
+        delete retired[i].second;
+    delete [] shards;
+}
+
+CachedTexture* TextureCache::acquire( const std::string& filename )
+{
+    std::lock_guard<std::mutex> guard( textures_lock );
+    CachedTexture*& texture = textures[filename];
+    if ( !texture )
+        texture = new CachedTexture( this, filename );
+    texture->references++;
+    return texture;
+}
+
+void TextureCache::release( CachedTexture* texture )
+{
+    std::lock_guard<std::mutex> guard( textures_lock );
+    if ( --texture->references == 0 ) {
+        textures.erase( texture->filename );
+        delete texture;
+    }
+}
+
+void TextureCache::set_memory_budget( size_t bytes )
+{
+    // half for the tiles, and every shard may hold at least one
+    shard_budget = std::max( bytes / 2 / TEXTURE_CACHE_SHARDS, sizeof( CachedTexture::Tile ) );
+    decoded_budget = bytes / 2;
+}
+
+TextureCache::Shard& TextureCache::shard_of( const std::atomic<CachedTexture::Tile*>* slot )
+{
+    // neighbouring tiles of a texture go to different shards
+    return shards[( (size_t) slot / sizeof *slot ) % TEXTURE_CACHE_SHARDS];
+}
+
+Color3 TextureCache::lookup( CachedTexture& texture, size_t index, int x, int y, real_t u, real_t v )
+{
+    CachedTexture::Level& level = texture.levels[index];
+    int tx = x / TEXTURE_TILE_STRIDE;
+    int ty = y / TEXTURE_TILE_STRIDE;
+
+    // the slot is read after announcing the epoch, both in the single
+    // total order of sequentially consistent operations
+    ReadGuard guard;
+    CachedTexture::Tile* tile = level.tiles[ty * level.tiles_x + tx].load();
+    if ( !tile ) {
+        tile = load_tile( texture, level, tx, ty );
+    } else if ( !tile->referenced.load( std::memory_order_relaxed ) ) {
+        tile->referenced.store( true, std::memory_order_relaxed );
+    }
+    return tile->bilinear( x - tx * TEXTURE_TILE_STRIDE, y - ty * TEXTURE_TILE_STRIDE, u, v );
+}
+
+// converts tile (tx, ty) from the RGBA8 level, decoding the texture again
+// if it was dropped, and makes room for it
+CachedTexture::Tile* TextureCache::load_tile( CachedTexture& texture, CachedTexture::Level& level,
+                                              int tx, int ty )
+{
+    CachedTexture::Tile* tile = new CachedTexture::Tile();
+    {
+        std::lock_guard<std::mutex> guard( texture.data_lock );
+        if ( texture.decode() ) {
+            tile->build( &level.data[0], level.width, level.height, tx, ty );
+        } else {
+            // the file went away since it was first decoded
+            static const unsigned char white[4] = { 255, 255, 255, 255 };
+            tile->build( white, 1, 1, tx, ty );
+        }
+    }
+
+    std::atomic<CachedTexture::Tile*>* slot = &level.tiles[ty * level.tiles_x + tx];
+    Shard& shard = shard_of( slot );
+    std::lock_guard<std::mutex> guard( shard.lock );
+
+    // another thread may have loaded it meanwhile
+    CachedTexture::Tile* other = slot->load( std::memory_order_relaxed );
+    if ( other ) {
+        delete tile;
+        return other;
+    }
+
+    // the clock hand clears the bits of recently used tiles and evicts the
+    // first tile it finds unused, or any tile after two rounds
+    size_t steps = 0;
+    while ( !shard.ring.empty() && shard.bytes + sizeof *tile > shard_budget ) {
+        if ( shard.hand >= shard.ring.size() )
+            shard.hand = 0;
+        CachedTexture::Tile* old = shard.ring[shard.hand];
+        if ( old->referenced.load( std::memory_order_relaxed ) && steps++ < 2 * shard.ring.size() ) {
+            old->referenced.store( false, std::memory_order_relaxed );
+            shard.hand++;
+            continue;
+        }
+        shard.remove( old );
+        old->slot->store( 0 );
+        retire( old );
+    }
+
+    tile->slot = slot;
+    tile->referenced.store( true, std::memory_order_relaxed );
+    shard.insert( tile );
+    slot->store( tile, std::memory_order_release );
+    return tile;
+}
+
+void TextureCache::retire( CachedTexture::Tile* tile )
+{
+    // lookups announcing a later epoch saw the cleared slot
+    unsigned long long epoch = tile_epoch.fetch_add( 1 );
+    std::lock_guard<std::mutex> guard( retired_lock );
+    retired.push_back( std::make_pair( epoch, tile ) );
+    if ( retired.size() >= TEXTURE_CACHE_RECLAIM_BATCH )
+        reclaim();
+}
+
+// frees the retired tiles no lookup can read any more, with retired_lock held
+void TextureCache::reclaim()
+{
+    unsigned long long oldest = tile_epoch.load();
+    {
+        std::lock_guard<std::mutex> guard( readers_lock );
+        for ( size_t i = 0; i < readers.size(); i++ ) {
+            unsigned long long epoch = readers[i]->epoch.load();
+            if ( epoch != 0 )
+                oldest = std::min( oldest, epoch );
+        }
+    }
+
+    size_t kept = 0;
+    for ( size_t i = 0; i < retired.size(); i++ ) {
+        if ( retired[i].first < oldest )
+            delete retired[i].second;
+        else
+            retired[kept++] = retired[i];
+    }
+    retired.resize( kept );
+}
+
+// with no references left, nothing looks up the tiles of texture
+void TextureCache::free_tiles( CachedTexture* texture )
+{
+    for ( size_t i = 0; i < texture->levels.size(); i++ ) {
+        std::vector< std::atomic<CachedTexture::Tile*> >& tiles = texture->levels[i].tiles;
+        for ( size_t j = 0; j < tiles.size(); j++ ) {
+            Shard& shard = shard_of( &tiles[j] );
+            std::lock_guard<std::mutex> guard( shard.lock );
+            CachedTexture::Tile* tile = tiles[j].load( std::memory_order_relaxed );
+            if ( tile ) {
+                shard.remove( tile );
+                delete tile;
+                tiles[j].store( 0, std::memory_order_relaxed );
+            }
+        }
+    }
+}
+
+// puts texture, just decoded into bytes, first in the LRU list and drops
+// the least recently used pyramids over budget, with texture's data_lock
+// held. Textures whose data_lock is taken are skipped rather than waited
+// for, as their holder may be waiting for decoded_lock.
+void TextureCache::add_decoded( CachedTexture* texture, size_t bytes )
+{
+    std::lock_guard<std::mutex> guard( decoded_lock );
+    texture->decoded = true;
+    texture->decoded_bytes = bytes;
+    texture->decoded_prev = 0;
+    texture->decoded_next = decoded_head;
+    if ( decoded_head )
+        decoded_head->decoded_prev = texture;
+    else
+        decoded_tail = texture;
+    decoded_head = texture;
+    decoded_bytes += bytes;
+
+    CachedTexture* victim = decoded_tail;
+    while ( decoded_bytes > decoded_budget && victim != texture ) {
+        CachedTexture* prev = victim->decoded_prev;
+        if ( victim->data_lock.try_lock() ) {
+            remove_decoded_locked( victim );
+            victim->drop_data();
+            victim->data_lock.unlock();
+        }
+        victim = prev;
+    }
+}
+
+void TextureCache::touch_decoded( CachedTexture* texture )
+{
+    std::lock_guard<std::mutex> guard( decoded_lock );
+    if ( texture == decoded_head )
+        return;
+    remove_decoded_locked( texture );
+    decoded_bytes += texture->decoded_bytes;
+    texture->decoded = true;
+    texture->decoded_prev = 0;
+    texture->decoded_next = decoded_head;
+    decoded_head->decoded_prev = texture;
+    decoded_head = texture;
+}
+
+void TextureCache::remove_decoded( CachedTexture* texture )
+{
+    std::lock_guard<std::mutex> guard( decoded_lock );
+    if ( texture->decoded )
+        remove_decoded_locked( texture );
+}
+
+// unlinks texture from the LRU list, with decoded_lock and its data_lock held
+void TextureCache::remove_decoded_locked( CachedTexture* texture )
+{
+    if ( texture->decoded_prev )
+        texture->decoded_prev->decoded_next = texture->decoded_next;
+    else
+        decoded_head = texture->decoded_next;
+    if ( texture->decoded_next )
+        texture->decoded_next->decoded_prev = texture->decoded_prev;
+    else
+        decoded_tail = texture->decoded_prev;
+    texture->decoded_prev = texture->decoded_next = 0;
+    texture->decoded = false;
+    decoded_bytes -= texture->decoded_bytes;
+}
+
+} /* _462 */
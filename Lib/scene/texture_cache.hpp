@@ -0,0 +1,178 @@
+/**
+ * @file texture_cache.hpp
+ * @brief Shared, lazily loaded textures with a bounded tile cache.
+ */
+
+#ifndef _462_SCENE_TEXTURE_CACHE_HPP_
+#define _462_SCENE_TEXTURE_CACHE_HPP_
+
+#include "scene/tiled_texture.hpp"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace _462 {
+
+#define TEXTURE_CACHE_SHARDS 64
+// default bytes of decoded textures and float tiles kept resident
+#define TEXTURE_CACHE_BUDGET ( 256 << 20 )
+
+class TextureCache;
+
+/**
+ * One texture file in the cache. The image is decoded, and its RGBA8 mip
+ * pyramid built, by the first call that needs it. The cache may drop the
+ * pyramid again, and decodes the file once more when a missing float tile
+ * has to be converted from it. The level sizes stay known throughout.
+ */
+class CachedTexture
+{
+public:
+
+    const std::string& get_filename() const { return filename; }
+
+    /// false if the file could not be decoded
+    bool is_valid();
+
+    size_t num_levels();
+    void get_level_size( size_t level, int* width, int* height );
+
+    /// copies the RGBA8 texels of level 0 in row-major order, false if invalid
+    bool get_data( std::vector<unsigned char>* data );
+
+    /// the texel at (x, y) of level, with x and y in range
+    Color3 get_pixel( size_t level, int x, int y );
+
+    /**
+     * Interpolates the texels (x, y) to (x+1, y+1) of level with weights
+     * u and v, with x and y in range. Wraps around the edges.
+     */
+    Color3 bilinear( size_t level, int x, int y, real_t u, real_t v );
+
+private:
+
+    friend class TextureCache;
+
+    struct Tile;
+
+    // a box filtered level, each half the size of the one before
+    struct Level {
+        int width, height;
+        int tiles_x;
+        // RGBA8 texels while decoded, guarded by data_lock
+        std::vector<unsigned char> data;
+        // resident tiles. Lookups read them without locks, the shard of
+        // the slot's address guards installing and evicting them.
+        std::vector< std::atomic<Tile*> > tiles;
+    };
+
+    CachedTexture( TextureCache* cache, const std::string& filename );
+    ~CachedTexture();
+
+    void load();
+    bool decode();
+    void drop_data();
+
+    TextureCache* cache;
+    std::string filename;
+    int references;
+
+    std::atomic<bool> loaded;
+    bool valid;
+    std::mutex data_lock;
+    std::vector<Level> levels;
+
+    // whether the pyramid is in memory, and its place in the cache's LRU
+    // list of decoded textures. Changed with both data_lock and the
+    // cache's decoded_lock held.
+    bool decoded;
+    size_t decoded_bytes;
+    CachedTexture* decoded_prev;
+    CachedTexture* decoded_next;
+
+    // prevent copy/assignment
+    CachedTexture( const CachedTexture& );
+    CachedTexture& operator=( const CachedTexture& );
+};
+
+/**
+ * Textures shared by file name, in the manner of OpenImageIO's texture
+ * cache: nothing is decoded until a lookup needs it, and decoded pyramids
+ * and float tiles stay resident under a memory budget, half for each.
+ * Decoded pyramids are dropped least recently used first. The tiles are
+ * spread over shards by address, each with its own lock and CLOCK
+ * eviction, which approximates least recently used.
+ *
+ * A lookup that finds its tile takes no lock and writes nothing shared
+ * except the tile's clock bit when it is not set yet. Only misses lock a
+ * shard. Evicted tiles are freed once no lookup that may still read them
+ * is running, see texture_cache.cpp.
+ */
+class TextureCache
+{
+public:
+
+    /// the cache shared by all materials
+    static TextureCache& global();
+
+    TextureCache();
+    ~TextureCache();
+
+    /**
+     * The texture of filename, shared with every other acquire of the same
+     * name. Does not read the file. Every acquire needs one release.
+     */
+    CachedTexture* acquire( const std::string& filename );
+    void release( CachedTexture* texture );
+
+    /// bytes of decoded textures and float tiles to keep resident
+    void set_memory_budget( size_t bytes );
+
+private:
+
+    friend class CachedTexture;
+
+    // a lock and the clock ring of resident tiles
+    struct Shard;
+
+    Color3 lookup( CachedTexture& texture, size_t level, int x, int y, real_t u, real_t v );
+    CachedTexture::Tile* load_tile( CachedTexture& texture, CachedTexture::Level& level,
+                                    int tx, int ty );
+    Shard& shard_of( const std::atomic<CachedTexture::Tile*>* slot );
+    void retire( CachedTexture::Tile* tile );
+    void reclaim();
+    void free_tiles( CachedTexture* texture );
+
+    void add_decoded( CachedTexture* texture, size_t bytes );
+    void touch_decoded( CachedTexture* texture );
+    void remove_decoded( CachedTexture* texture );
+    void remove_decoded_locked( CachedTexture* texture );
+
+    Shard* shards;
+    size_t shard_budget;
+
+    // decoded textures, most recently used first
+    std::mutex decoded_lock;
+    CachedTexture* decoded_head;
+    CachedTexture* decoded_tail;
+    size_t decoded_bytes;
+    size_t decoded_budget;
+
+    // evicted tiles and the epoch they were evicted in, freed by reclaim
+    std::mutex retired_lock;
+    std::vector< std::pair<unsigned long long, CachedTexture::Tile*> > retired;
+
+    std::mutex textures_lock;
+    std::map<std::string, CachedTexture*> textures;
+
+    // prevent copy/assignment
+    TextureCache( const TextureCache& );
+    TextureCache& operator=( const TextureCache& );
+};
+
+} /* _462 */
+
+#endif /* _462_SCENE_TEXTURE_CACHE_HPP_ */
@@ -0,0 +1,73 @@
+/**
+ * @file tiled_texture.cpp
+ * @brief Texture tiles laid out for bilinear filtering.
+ */
+
+#include "scene/tiled_texture.hpp"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+namespace _462 {
+
+// the bits of a 3 bit coordinate, spread to every other bit
+static const int MORTON_SPREAD[TEXTURE_TILE_SIZE] = { 0, 1, 4, 5, 16, 17, 20, 21 };
+
+static inline int morton( int x, int y )
+{
+    return MORTON_SPREAD[x] | ( MORTON_SPREAD[y] << 1 );
+}
+
+void TextureTile::build( const unsigned char* data, int width, int height, int tx, int ty )
+{
+    static const float inv = 1.0f / 255.0f;
+    for ( int y = 0; y < TEXTURE_TILE_SIZE; y++ ) {
+        int sy = ( ty * TEXTURE_TILE_STRIDE + y ) % height;
+        for ( int x = 0; x < TEXTURE_TILE_SIZE; x++ ) {
+            int sx = ( tx * TEXTURE_TILE_STRIDE + x ) % width;
+            const unsigned char* src = data + 4 * ( sx + sy * width );
+            float* t = texels[morton( x, y )];
+            for ( int c = 0; c < 4; c++ ) {
+                t[c] = src[c] * inv;
+            }
+        }
+    }
+}
+
+Color3 TextureTile::get_pixel( int x, int y ) const
+{
+    const float* t = texels[morton( x, y )];
+    return Color3( t[0], t[1], t[2] );
+}
+
+Color3 TextureTile::bilinear( int x, int y, real_t u, real_t v ) const
+{
+    const float* t00 = texels[morton( x, y )];
+    const float* t10 = texels[morton( x + 1, y )];
+    const float* t01 = texels[morton( x, y + 1 )];
+    const float* t11 = texels[morton( x + 1, y + 1 )];
+
+    float w00 = float( ( 1 - u ) * ( 1 - v ) );
+    float w10 = float( u * ( 1 - v ) );
+    float w01 = float( ( 1 - u ) * v );
+    float w11 = float( u * v );
+
+#ifdef __SSE__
+    __m128 sum = _mm_mul_ps( _mm_loadu_ps( t00 ), _mm_set1_ps( w00 ) );
+    sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( t10 ), _mm_set1_ps( w10 ) ) );
+    sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( t01 ), _mm_set1_ps( w01 ) ) );
+    sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( t11 ), _mm_set1_ps( w11 ) ) );
+    float c[4];
+    _mm_storeu_ps( c, sum );
+#else
+    float c[4];
+    for ( int i = 0; i < 4; i++ ) {
+        c[i] = t00[i] * w00 + t10[i] * w10 + t01[i] * w01 + t11[i] * w11;
+    }
+#endif
+
+    return Color3( c[0], c[1], c[2] );
+}
+
+} /* _462 */
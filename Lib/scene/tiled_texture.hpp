@@ -0,0 +1,50 @@
+/**
+ * @file tiled_texture.hpp
+ * @brief Texture tiles laid out for bilinear filtering.
+ */
+
+#ifndef _462_SCENE_TILED_TEXTURE_HPP_
+#define _462_SCENE_TILED_TEXTURE_HPP_
+
+#include "math/color.hpp"
+
+namespace _462 {
+
+#define TEXTURE_TILE_SIZE 8
+#define TEXTURE_TILE_TEXELS ( TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE )
+// tiles overlap by one texel, so every 2x2 footprint lies in one tile
+#define TEXTURE_TILE_STRIDE ( TEXTURE_TILE_SIZE - 1 )
+
+/// number of tiles along an edge of size texels
+inline int texture_tile_count( int size )
+{
+    return ( size + TEXTURE_TILE_STRIDE - 1 ) / TEXTURE_TILE_STRIDE;
+}
+
+/**
+ * An 8x8 block of an RGBA texture converted to float, with its texels in
+ * Morton order. A tile is 1KB, and the four texels of a bilinear
+ * footprint are usually within one cache line. Tile (tx, ty) starts at
+ * texel (tx, ty) * TEXTURE_TILE_STRIDE, and coordinates wrap around the
+ * edges of the texture.
+ */
+struct TextureTile
+{
+    float texels[TEXTURE_TILE_TEXELS][4];
+
+    /// fills in tile (tx, ty) of width*height RGBA8 texels in row-major order
+    void build( const unsigned char* data, int width, int height, int tx, int ty );
+
+    /// the texel at (x, y) within the tile, with x, y < TEXTURE_TILE_STRIDE
+    Color3 get_pixel( int x, int y ) const;
+
+    /**
+     * Interpolates the texels (x, y) to (x+1, y+1) of the tile with
+     * weights u and v, with x, y < TEXTURE_TILE_STRIDE.
+     */
+    Color3 bilinear( int x, int y, real_t u, real_t v ) const;
+};
+
+} /* _462 */
+
+#endif /* _462_SCENE_TILED_TEXTURE_HPP_ */
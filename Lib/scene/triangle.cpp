@@ -19,6 +19,20 @@ Triangle::Triangle()
 
 Triangle::~Triangle() { }
 
+// passes v to OpenGL in the precision of real_t
+static void render_vertex(const Triangle::Vertex& v)
+{
+#ifdef REAL_FLOAT
+    glNormal3fv( &v.normal.x );
+    glTexCoord2fv( &v.tex_coord.x );
+    glVertex3fv( &v.position.x );
+#else
+    glNormal3dv( &v.normal.x );
+    glTexCoord2dv( &v.tex_coord.x );
+    glVertex3dv( &v.position.x );
+#endif
+}
+
 void Triangle::render() const
 {
     bool materials_nonnull = true;
@@ -31,17 +45,9 @@ void Triangle::render() const
 
     glBegin(GL_TRIANGLES);
 
-    glNormal3dv( &vertices[0].normal.x );
-    glTexCoord2dv( &vertices[0].tex_coord.x );
-    glVertex3dv( &vertices[0].position.x );
-
-    glNormal3dv( &vertices[1].normal.x );
-    glTexCoord2dv( &vertices[1].tex_coord.x );
-    glVertex3dv( &vertices[1].position.x);
-
-    glNormal3dv( &vertices[2].normal.x );
-    glTexCoord2dv( &vertices[2].tex_coord.x );
-    glVertex3dv( &vertices[2].position.x);
+    render_vertex( vertices[0] );
+    render_vertex( vertices[1] );
+    render_vertex( vertices[2] );
 
     glEnd();
 
@@ -50,7 +56,7 @@ void Triangle::render() const
 }
 
 
-bool Triangle::checkIntersection(Ray r, Solution_info &s, const real_t &t_max)
+bool Triangle::checkIntersection(const Ray& r, Solution_info &s, const real_t &t_max)
 {   
 
     Vector3 e_local = invMat.transform_point(r.e);
@@ -80,7 +86,7 @@ bool Triangle::checkIntersection(Ray r, Solution_info &s, const real_t &t_max)
 
     v_solution = minv*v_right;
 
-    if (v_solution.z<0.000001 || v_solution.z > t_max){
+    if (v_solution.z<TRIANGLE_EPSILON+hit_offset(r) || v_solution.z > t_max){
         return false;
     }
     if (v_solution.y<0.0 || v_solution.y>1.0) {
@@ -99,35 +105,97 @@ bool Triangle::checkIntersection(Ray r, Solution_info &s, const real_t &t_max)
 }
 
 
-Material_Para Triangle::getMaterial(Ray r, Solution_info s) {
+Material_Para Triangle::getMaterial(const Ray& r, const Solution_info& s, unsigned int fields) {
 
-    Vector3 e_local = invMat.transform_point(r.e);
-    Vector3 d_local = invMat.transform_vector(r.d);
-    
     real_t alpha = 1.0-s.beta-s.gamma;
-    
+
+    // most triangles have one material, which needs no interpolation
+    const Material* material = vertices[0].material;
+    bool single_material = material == vertices[1].material && material == vertices[2].material;
+
+    Material_Para returnPara;
+    if (fields & MATERIAL_COLORS) {
+        if (single_material) {
+            returnPara.ambient = material->ambient;
+            returnPara.diffuse = material->diffuse;
+            returnPara.specular = material->specular;
+            returnPara.refractive_index = material->refractive_index;
+        } else {
+            returnPara.ambient = this->vertices[0].material->ambient*alpha + this->vertices[1].material->ambient*s.beta + this->vertices[2].material->ambient*s.gamma;
+            returnPara.diffuse = this->vertices[0].material->diffuse*alpha + this->vertices[1].material->diffuse*s.beta + this->vertices[2].material->diffuse*s.gamma;
+            returnPara.specular = this->vertices[0].material->specular*alpha + this->vertices[1].material->specular*s.beta + this->vertices[2].material->specular*s.gamma;
+            returnPara.refractive_index = this->vertices[0].material->refractive_index*alpha + this->vertices[1].material->refractive_index*s.beta + this->vertices[2].material->refractive_index*s.gamma;  
+        }
+    }
+
+    bool texture = (fields & MATERIAL_TEXTURE) != 0;
+    if ((fields & MATERIAL_NORMAL) || (texture && r.has_differentials)) {
+        Vector3 local_normal = this->vertices[0].normal*alpha + this->vertices[1].normal*s.beta + this->vertices[2].normal*s.gamma;
+        returnPara.normal = normalize(this->normMat*local_normal);  
+    }
+    if (!texture) {
+        return returnPara;
+    }
+
     // interpolate the texature 2D coord
     Vector2 tex_coord = this->vertices[0].tex_coord*alpha + this->vertices[1].tex_coord*s.beta + this->vertices[2].tex_coord*s.gamma;
 
+    // texture footprint from the ray differentials
+    Vector2 dtdx(0, 0), dtdy(0, 0);
+    if (r.has_differentials) {
+        Vector3 dpdx, dpdy;
+        r.hit_differentials(s.t, returnPara.normal, dpdx, dpdy);
+        Vector3 p[3] = { vertices[0].position, vertices[1].position, vertices[2].position };
+        Vector2 t[3] = { vertices[0].tex_coord, vertices[1].tex_coord, vertices[2].tex_coord };
+        dtdx = texture_coord_delta(p, t, invMat.transform_vector(dpdx));
+        dtdy = texture_coord_delta(p, t, invMat.transform_vector(dpdy));
+    }
 
-    Material_Para returnPara;
-    returnPara.ambient = this->vertices[0].material->ambient*alpha + this->vertices[1].material->ambient*s.beta + this->vertices[2].material->ambient*s.gamma;
-    returnPara.diffuse = this->vertices[0].material->diffuse*alpha + this->vertices[1].material->diffuse*s.beta + this->vertices[2].material->diffuse*s.gamma;
-    returnPara.specular = this->vertices[0].material->specular*alpha + this->vertices[1].material->specular*s.beta + this->vertices[2].material->specular*s.gamma;
-    returnPara.refractive_index = this->vertices[0].material->refractive_index*alpha + this->vertices[1].material->refractive_index*s.beta + this->vertices[2].material->refractive_index*s.gamma;  
-    
     // texture
-    returnPara.texture = vertices[0].material->texture_lookup(tex_coord)*alpha
-                       + this->vertices[1].material->texture_lookup(tex_coord)*s.beta
-                       + this->vertices[2].material->texture_lookup(tex_coord)*s.gamma;
-
-    Vector3 local_normal = this->vertices[0].normal*alpha + this->vertices[1].normal*s.beta + this->vertices[2].normal*s.gamma;
-    returnPara.normal = normalize(this->normMat*local_normal);  
+    if (single_material) {
+        returnPara.texture = material->texture_lookup(tex_coord, dtdx, dtdy);
+    } else {
+        returnPara.texture = vertices[0].material->texture_lookup(tex_coord, dtdx, dtdy)*alpha
+                           + this->vertices[1].material->texture_lookup(tex_coord, dtdx, dtdy)*s.beta
+                           + this->vertices[2].material->texture_lookup(tex_coord, dtdx, dtdy)*s.gamma;
+    }
 
 
     return returnPara;  
 }
 
+unsigned long long Triangle::hash( unsigned long long seed ) const
+{
+    seed = Geometry::hash( seed );
+    for ( int i = 0; i < 3; ++i ) {
+        seed = hash_bytes( &vertices[i].position, sizeof vertices[i].position, seed );
+        seed = hash_bytes( &vertices[i].normal, sizeof vertices[i].normal, seed );
+        seed = hash_bytes( &vertices[i].tex_coord, sizeof vertices[i].tex_coord, seed );
+        if ( vertices[i].material )
+            seed = vertices[i].material->hash( seed );
+    }
+    return seed;
+}
+
+void Triangle::get_bounds( Vector3* min, Vector3* max ) const
+{
+    *min = *max = mat.transform_point( vertices[0].position );
+    for ( int i = 1; i < 3; ++i ) {
+        Vector3 p = mat.transform_point( vertices[i].position );
+        *min = vmin( *min, p );
+        *max = vmax( *max, p );
+    }
+}
+
+bool Triangle::has_specular() const
+{
+    for ( int i = 0; i < 3; ++i ) {
+        if ( vertices[i].material && vertices[i].material->is_specular() )
+            return true;
+    }
+    return false;
+}
+
 void Triangle::printname() {
 
     printf("this is triangle\n");
@@ -10,6 +10,7 @@
 
 #include "raytracer.hpp"
 #include "scene/scene.hpp"
+#include "math/sampling.hpp"
 
 #include <SDL_timer.h>
 #include <iostream>
@@ -123,21 +124,10 @@ Color3 Raytracer::trace_pixel(const Scene* scene,
     return res*(real_t(1)/num_samples);
 }
 
+// uniform random point on the sphere around pt
 Vector3 Raytracer::create_montecarol(Vector3 pt, real_t radius) {
 
-    
-    real_t x = random_gaussian();
-    real_t y = random_gaussian();
-    real_t z = random_gaussian();
-    
-    real_t x_new = x / pow(x*x + y*y + z*z, 1/2);
-    real_t y_new = y / pow(x*x + y*y + z*z, 1/2);
-    real_t z_new = z / pow(x*x + y*y + z*z, 1/2);
-    
-    Vector3 v(x_new, y_new, z_new);
-    v = v*radius + pt;
-
-    return v;
+    return pt + radius*sample_uniform_sphere(random(), random());
 }
 
 Color3 Raytracer::calDiffuseColor(Vector3 pt, Material_Para material_para) {
@@ -250,7 +240,7 @@ Color3 Raytracer::calDiffuseColor(Vector3 pt, Material_Para material_para) {
 }
 
 
-Color3 Raytracer::recursive_raytracing(Ray r, size_t reflectTime) 
+Color3 Raytracer::recursive_raytracing(const Ray& r, size_t reflectTime) 
 {   
 
     size_t const recursion_limit = 5;
@@ -38,7 +38,7 @@ public:
 
     /* not yet implemented */
 
-    Color3 recursive_raytracing (Ray r, size_t reflectTime); 
+    Color3 recursive_raytracing (const Ray& r, size_t reflectTime); 
     Color3 calDiffuseColor(Vector3 pt, Material_Para material_para);
     Vector3 create_montecarol(Vector3 pt, real_t radius);
     bool caculate_Refracted_Ray(real_t &R, Material_Para material_para, Ray r, Vector3 &newray);